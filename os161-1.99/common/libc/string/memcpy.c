@@ -47,39 +47,62 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d = dst;
+	const char *s = src;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For speedy copying, copy word-at-a-time whenever the two
+	 * pointers are the same distance from a word boundary: copy
+	 * bytes until they are both aligned, then words, eight at a
+	 * time while there are that many left, then the leftover
+	 * bytes. If the pointers are misaligned relative to each
+	 * other, no word access can be aligned on both sides; copy by
+	 * bytes.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (len >= sizeof(long) &&
+	    ((uintptr_t)d - (uintptr_t)s) % sizeof(long) == 0) {
+		long *dl;
+		const long *sl;
 
-		long *d = dst;
-		const long *s = src;
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		dl = (long *)d;
+		sl = (const long *)s;
+		while (len >= 8*sizeof(long)) {
+			dl[0] = sl[0];
+			dl[1] = sl[1];
+			dl[2] = sl[2];
+			dl[3] = sl[3];
+			dl[4] = sl[4];
+			dl[5] = sl[5];
+			dl[6] = sl[6];
+			dl[7] = sl[7];
+			dl += 8;
+			sl += 8;
+			len -= 8*sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*dl++ = *sl++;
+			len -= sizeof(long);
 		}
+		d = (char *)dl;
+		s = (const char *)sl;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
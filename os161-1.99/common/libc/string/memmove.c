@@ -48,14 +48,14 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	char *d;
+	const char *s;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
-	 * we copy in. If they do, it does, so just assume they always do.
-	 * We don't concern ourselves with the possibility that the region
-	 * to copy might roll over across the top of memory, because it's
-	 * not going to happen.
+	 * we copy in. If they do, it does. We don't concern ourselves
+	 * with the possibility that the region to copy might roll over
+	 * across the top of memory, because it's not going to happen.
 	 *
 	 * If the destination is above the source, we have to copy
 	 * back to front to avoid overwriting the data we want to
@@ -75,7 +75,8 @@ memmove(void *dst, const void *src, size_t len)
          *                     |___|
 	 */
 
-	if ((uintptr_t)dst < (uintptr_t)src) {
+	if ((uintptr_t)dst < (uintptr_t)src ||
+	    (uintptr_t)dst >= (uintptr_t)src + len) {
 		/*
 		 * As author/maintainer of libc, take advantage of the
 		 * fact that we know memcpy copies forwards.
@@ -84,33 +85,36 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Copy by words when we can, as in memcpy (look there for
+	 * more information), only working down from the end.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (char *)dst + len;
+	s = (const char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (len >= sizeof(long) &&
+	    ((uintptr_t)d - (uintptr_t)s) % sizeof(long) == 0) {
+		long *dl;
+		const long *sl;
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		dl = (long *)d;
+		sl = (const long *)s;
+		while (len >= sizeof(long)) {
+			*--dl = *--sl;
+			len -= sizeof(long);
 		}
+		d = (char *)dl;
+		s = (const char *)sl;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -141,6 +141,9 @@ mips_trap(struct trapframe *tf)
 
 	KASSERT(code < NTRAPCODES);
 
+	/* Interrupts are still off, so the cheap increment is safe. */
+	_cpustat_inc(CPUSTAT_TRAP(code));
+
 	/* Make sure we haven't run off our stack */
 	if (curthread != NULL && curthread->t_stack != NULL) {
 		KASSERT((vaddr_t)tf > (vaddr_t)curthread->t_stack);
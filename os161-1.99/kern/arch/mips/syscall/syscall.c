@@ -33,8 +33,10 @@
 #include <lib.h>
 #include <mips/trapframe.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
 
 
 /*
@@ -81,6 +83,9 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#ifdef UW
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -88,6 +93,10 @@ syscall(struct trapframe *tf)
 
 	callno = tf->tf_v0;
 
+	if (callno >= 0 && callno < CPUSTAT_NSYSCALLS) {
+		cpustat_inc(CPUSTAT_SYSCALL(callno));
+	}
+
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
 	 * really return a value, just 0 for success and -1 on
@@ -115,6 +124,41 @@ syscall(struct trapframe *tf)
 			  (int)tf->tf_a2,
 			  (int *)(&retval));
 	  break;
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (int *)(&retval));
+	  break;
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)(&retval));
+	  break;
+	case SYS_preadv:
+	case SYS_pwritev:
+	  /* the 64-bit offset is aligned, so it skips a3 and lands
+	     on the stack; see the comment above */
+	  err = copyin((userptr_t)(tf->tf_sp + 16), &offset, sizeof(offset));
+	  if (err) {
+	    break;
+	  }
+	  if (callno == SYS_preadv) {
+	    err = sys_preadv((int)tf->tf_a0,
+			     (userptr_t)tf->tf_a1,
+			     (int)tf->tf_a2,
+			     offset,
+			     (int *)(&retval));
+	  }
+	  else {
+	    err = sys_pwritev((int)tf->tf_a0,
+			      (userptr_t)tf->tf_a1,
+			      (int)tf->tf_a2,
+			      offset,
+			      (int *)(&retval));
+	  }
+	  break;
 	case SYS__exit:
 	  sys__exit((int)tf->tf_a0);
 	  /* sys__exit does not return, execution should not get here */
@@ -270,6 +270,7 @@ mainbus_interrupt(struct trapframe *tf)
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
 		mips_timer_set(CPU_FREQUENCY / HZ);
+		_cpustat_inc(CPUSTAT_TIMER);
 		/* and call hardclock */
 		hardclock();
 	}
@@ -46,6 +46,14 @@
  * and (2) if the system crashes before we find a console, no output
  * at all may appear.
  *
+ * Output from thread context is queued in a ring buffer in the
+ * softc, cs_outbuf, and the write-done interrupt (con_start) sends
+ * the next character from it. Writers only wait when the buffer is
+ * full, so a write() to the console copies its data in and returns,
+ * rather than sleeping once per character. Polled output (interrupt
+ * handlers, interrupts off, panics) empties the buffer first so
+ * output stays in order.
+ *
  * Note that we have no input buffering; characters typed too rapidly
  * will be lost.
  */
@@ -57,6 +65,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -67,6 +76,11 @@
  */
 static struct con_softc *the_console = NULL;
 
+/*
+ * Size of the chunks con_io copies user data in.
+ */
+#define CON_CHUNKSIZE 128
+
 /*
  * Lock so user I/Os are atomic.
  * We use two locks so readers waiting for input don't lock out writers.
@@ -111,6 +125,41 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Send out whatever is sitting in the output buffer by polling, so
+ * polled output doesn't get ahead of it. If this CPU already holds
+ * the output lock (e.g. we're panicking inside con_output) the
+ * buffer is left alone.
+ *
+ * If the device is still busy with a character from the buffer,
+ * sendpolled waits for it and leaves the write-done interrupt
+ * pending; con_start then finds the buffer empty.
+ */
+static
+void
+putch_drain_polled(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	if (spinlock_do_i_hold(&cs->cs_outlock)) {
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_outlock);
+	while (cs->cs_outcount > 0) {
+		ch = cs->cs_outbuf[cs->cs_outtail];
+		cs->cs_outtail =
+			(cs->cs_outtail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+		cs->cs_outcount--;
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+	}
+	if (cs->cs_outwaiting) {
+		cs->cs_outwaiting = false;
+		wchan_wakeall(cs->cs_outwchan);
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
@@ -119,6 +168,9 @@ static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	if (cs->cs_outcount > 0) {
+		putch_drain_polled(cs);
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
@@ -142,6 +194,83 @@ putch_complete_polled(struct con_softc *cs)
 
 //////////////////////////////////////////////////
 
+/*
+ * If the device is idle, hand it the next character from the output
+ * buffer. Wake up writers waiting for space once the buffer is down
+ * to half full, so they don't wake for every character.
+ */
+static
+void
+con_outstart(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	if (cs->cs_sending || cs->cs_outcount == 0) {
+		return;
+	}
+
+	ch = cs->cs_outbuf[cs->cs_outtail];
+	cs->cs_outtail = (cs->cs_outtail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outcount--;
+	cs->cs_sending = true;
+	cs->cs_send(cs->cs_devdata, ch);
+
+	if (cs->cs_outwaiting &&
+	    cs->cs_outcount <= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		cs->cs_outwaiting = false;
+		wchan_wakeall(cs->cs_outwchan);
+	}
+}
+
+/*
+ * Put a character in the output buffer, waiting for space if
+ * necessary. Called with cs_outlock held.
+ */
+static
+void
+con_outchar(struct con_softc *cs, unsigned char ch)
+{
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	while (cs->cs_outcount == CONSOLE_OUTPUT_BUFFER_SIZE) {
+		con_outstart(cs);
+		cs->cs_outwaiting = true;
+
+		/* Same handoff as in P(). */
+		wchan_lock(cs->cs_outwchan);
+		spinlock_release(&cs->cs_outlock);
+		wchan_sleep(cs->cs_outwchan);
+		spinlock_acquire(&cs->cs_outlock);
+	}
+
+	cs->cs_outbuf[cs->cs_outhead] = ch;
+	cs->cs_outhead = (cs->cs_outhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outcount++;
+}
+
+/*
+ * Print a string of characters, using interrupts to wait for I/O
+ * completion. If CRLF is set, newlines become CR-LF.
+ */
+static
+void
+con_output(struct con_softc *cs, const char *buf, size_t len, bool crlf)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		if (crlf && buf[i] == '\n') {
+			con_outchar(cs, '\r');
+		}
+		con_outchar(cs, buf[i]);
+	}
+	con_outstart(cs);
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -149,8 +278,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_output(cs, &c, 1, false);
 }
 
 /*
@@ -198,13 +328,17 @@ con_input(void *vcs, int ch)
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next queued character, if any.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	cs->cs_sending = false;
+	con_outstart(cs);
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -233,6 +367,26 @@ putch(int ch)
 	}
 }
 
+/*
+ * Print a string of characters. Same as calling putch on each one,
+ * but in thread context it takes the output lock only once.
+ */
+void
+putchars(const char *buf, size_t len)
+{
+	struct con_softc *cs = the_console;
+	size_t i;
+
+	if (cs != NULL && !curthread->t_in_interrupt &&
+	    curthread->t_iplhigh_count == 0) {
+		con_output(cs, buf, len, false);
+		return;
+	}
+	for (i=0; i<len; i++) {
+		putch(buf[i]);
+	}
+}
+
 void
 putch_prepare(void)
 {
@@ -304,9 +458,10 @@ con_io(struct device *dev, struct uio *uio)
 {
 	int result;
 	char ch;
+	char buf[CON_CHUNKSIZE];
+	size_t len;
 	struct lock *lk;
-
-	(void)dev;  // unused
+	struct con_softc *cs = dev->d_data;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -334,15 +489,16 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(buf)) {
+				len = sizeof(buf);
+			}
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+			con_output(cs, buf, len, true);
 		}
 	}
 	lock_release(lk);
@@ -398,7 +554,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *outwchan;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -418,30 +575,37 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	outwchan = wchan_create("console write");
+	if (outwchan == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(outwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(outwchan);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
 
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outwchan = outwchan;
+	cs->cs_outwaiting = false;
+	cs->cs_sending = false;
+	cs->cs_outhead = 0;
+	cs->cs_outtail = 0;
+	cs->cs_outcount = 0;
+
 	the_console = cs;
 	con_userlock_read = rlk;
 	con_userlock_write = wlk;
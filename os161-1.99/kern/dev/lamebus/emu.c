@@ -38,6 +38,22 @@
  * This makes it unnecessary to copy the system files to the simulated
  * disk, although we recommend doing so and trying running without this
  * device as part of testing your filesystem.
+ *
+ * The device does one operation at a time, through a single I/O
+ * buffer, under e_lock. To cut down on trips through it, each open
+ * file keeps a read cache of one full buffer (EMU_MAXIO bytes): a
+ * read that misses fetches a whole buffer starting where it begins,
+ * and the reads after it are served from memory under the vnode's
+ * own ev_lock without touching the device. Reads of a whole buffer
+ * or more skip the cache and go straight to the caller. The file
+ * size is cached the same way for stat.
+ *
+ * Writes go straight through. Each write or truncate bumps e_wgen,
+ * and a cache is only good while e_wgen is what it was when the
+ * cache was filled; so a write through any handle invalidates every
+ * cached copy, including those of other handles for the same file.
+ * Changes made on the host behind our back aren't noticed until the
+ * file is closed, which is when the read cache is let go.
  */
 
 #include <types.h>
@@ -260,12 +276,13 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 }
 
 /*
- * Common code for read and readdir.
+ * Common code for read and readdir. If GEN isn't NULL, hands back
+ * the write generation the data belongs to.
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	   uint32_t op, struct uio *uio)
+	   uint32_t op, struct uio *uio, uint32_t *gen)
 {
 	int result;
 
@@ -285,6 +302,9 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
 
 	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	if (gen != NULL) {
+		*gen = sc->e_wgen;
+	}
 
  out:
 	lock_release(sc->e_lock);
@@ -297,9 +317,9 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 static
 int
 emu_read(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	 struct uio *uio)
+	 struct uio *uio, uint32_t *gen)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READ, uio);
+	return emu_doread(sc, handle, len, EMU_OP_READ, uio, gen);
 }
 
 /*
@@ -310,7 +330,7 @@ int
 emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	    struct uio *uio)
 {
-	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio);
+	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio, NULL);
 }
 
 /*
@@ -339,17 +359,22 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
 	result = emu_waitdone(sc);
 
+	/* Even a failed write may have changed something. */
+	sc->e_wgen++;
+
  out:
 	lock_release(sc->e_lock);
 	return result;
 }
 
 /*
- * Get the file size associated with a hardware-level file handle.
+ * Get the file size associated with a hardware-level file handle,
+ * and the write generation it belongs to.
  */
 static
 int
-emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
+emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval,
+	    uint32_t *gen)
 {
 	int result;
 
@@ -360,6 +385,7 @@ emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 	result = emu_waitdone(sc);
 	if (result==0) {
 		*retval = emu_rreg(sc, REG_IOLEN);
+		*gen = sc->e_wgen;
 	}
 
 	lock_release(sc->e_lock);
@@ -381,6 +407,7 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OPER, EMU_OP_TRUNC);
 	result = emu_waitdone(sc);
+	sc->e_wgen++;
 
 	lock_release(sc->e_lock);
 	return result;
@@ -399,6 +426,72 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 static int emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			   struct emufs_vnode **ret);
 
+/*
+ * Check if byte OFFSET of the file is in EV's read cache. e_wgen is
+ * read without e_lock; a single word read can't be torn, and a write
+ * that finishes after we look can be taken to have come after this
+ * read.
+ */
+static
+bool
+emufs_incache(struct emufs_vnode *ev, off_t offset)
+{
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	return ev->ev_cachelen > 0 &&
+		ev->ev_cachegen == ev->ev_emu->e_wgen &&
+		offset >= ev->ev_cacheoff &&
+		offset < ev->ev_cacheoff + ev->ev_cachelen;
+}
+
+/*
+ * Fill EV's read cache with the EMU_MAXIO bytes starting at OFFSET.
+ * Leaves it empty at end of file.
+ */
+static
+int
+emufs_fillcache(struct emufs_vnode *ev, off_t offset)
+{
+	struct iovec iov;
+	struct uio ku;
+	uint32_t gen;
+	int result;
+
+	KASSERT(lock_do_i_hold(ev->ev_lock));
+
+	if (ev->ev_cache == NULL) {
+		ev->ev_cache = kmalloc(EMU_MAXIO);
+		if (ev->ev_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	ev->ev_cachelen = 0;
+	uio_kinit(&iov, &ku, ev->ev_cache, EMU_MAXIO, offset, UIO_READ);
+	result = emu_read(ev->ev_emu, ev->ev_handle, EMU_MAXIO, &ku, &gen);
+	if (result) {
+		return result;
+	}
+	ev->ev_cacheoff = offset;
+	ev->ev_cachelen = EMU_MAXIO - ku.uio_resid;
+	ev->ev_cachegen = gen;
+	return 0;
+}
+
+/*
+ * Let go of EV's read cache.
+ */
+static
+void
+emufs_dropcache(struct emufs_vnode *ev)
+{
+	if (ev->ev_cache != NULL) {
+		kfree(ev->ev_cache);
+		ev->ev_cache = NULL;
+	}
+	ev->ev_cachelen = 0;
+}
+
 /*
  * VOP_OPEN on files
  */
@@ -448,12 +541,18 @@ emufs_opendir(struct vnode *v, int openflags)
 
 /*
  * VOP_CLOSE
+ *
+ * The read cache is only worth its memory while the file is open.
  */
 static
 int
 emufs_close(struct vnode *v)
 {
-	(void)v;
+	struct emufs_vnode *ev = v->vn_data;
+
+	lock_acquire(ev->ev_lock);
+	emufs_dropcache(ev);
+	lock_release(ev->ev_lock);
 	return 0;
 }
 
@@ -472,24 +571,27 @@ emufs_reclaim(struct vnode *v)
 	int result;
 
 	/*
-	 * Need both of these locks, e_lock to protect the device
-	 * and vfs_biglock to protect the fs-related material.
+	 * e_lock protects both the device and the vnode table, so
+	 * holding it keeps emufs_loadvnode from picking this vnode
+	 * up while we decide whether to get rid of it.
 	 */
-
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -513,8 +615,9 @@ emufs_reclaim(struct vnode *v)
 	VOP_CLEANUP(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
+	emufs_dropcache(ev);
+	lock_destroy(ev->ev_lock);
 	kfree(ev);
 	return 0;
 }
@@ -527,13 +630,44 @@ int
 emufs_read(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	uint32_t amt;
+	uint32_t amt, skip;
 	size_t oldresid;
-	int result;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+	lock_acquire(ev->ev_lock);
 	while (uio->uio_resid > 0) {
+		if (emufs_incache(ev, uio->uio_offset)) {
+			skip = uio->uio_offset - ev->ev_cacheoff;
+			amt = ev->ev_cachelen - skip;
+			if (amt > uio->uio_resid) {
+				amt = uio->uio_resid;
+			}
+			result = uiomove(ev->ev_cache + skip, amt, uio);
+			if (result) {
+				break;
+			}
+			continue;
+		}
+
+		if (uio->uio_resid < EMU_MAXIO) {
+			/* Read ahead a whole buffer into the cache. */
+			result = emufs_fillcache(ev, uio->uio_offset);
+			if (result == 0 && ev->ev_cachelen == 0) {
+				/* nothing read - EOF */
+				break;
+			}
+			if (result != ENOMEM) {
+				if (result) {
+					break;
+				}
+				continue;
+			}
+			/* No memory for a cache; do without. */
+			result = 0;
+		}
+
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
 			amt = EMU_MAXIO;
@@ -541,9 +675,9 @@ emufs_read(struct vnode *v, struct uio *uio)
 
 		oldresid = uio->uio_resid;
 
-		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio);
+		result = emu_read(ev->ev_emu, ev->ev_handle, amt, uio, NULL);
 		if (result) {
-			return result;
+			break;
 		}
 		
 		if (uio->uio_resid == oldresid) {
@@ -551,8 +685,9 @@ emufs_read(struct vnode *v, struct uio *uio)
 			break;
 		}
 	}
+	lock_release(ev->ev_lock);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -641,10 +776,18 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
-	if (result) {
-		return result;
+	lock_acquire(ev->ev_lock);
+	if (!ev->ev_sizevalid || ev->ev_sizegen != ev->ev_emu->e_wgen) {
+		result = emu_getsize(ev->ev_emu, ev->ev_handle,
+				     &ev->ev_size, &ev->ev_sizegen);
+		if (result) {
+			lock_release(ev->ev_lock);
+			return result;
+		}
+		ev->ev_sizevalid = true;
 	}
+	statbuf->st_size = ev->ev_size;
+	lock_release(ev->ev_lock);
 
 	result = VOP_GETTYPE(v, &statbuf->st_mode);
 	if (result) {
@@ -1153,7 +1296,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1166,7 +1308,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1182,12 +1323,26 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_cache = NULL;
+	ev->ev_cacheoff = 0;
+	ev->ev_cachelen = 0;
+	ev->ev_cachegen = 0;
+	ev->ev_size = 0;
+	ev->ev_sizevalid = false;
+	ev->ev_sizegen = 0;
+
+	ev->ev_lock = lock_create("emufs-vnode");
+	if (ev->ev_lock == NULL) {
+		lock_release(ef->ef_emu->e_lock);
+		kfree(ev);
+		return ENOMEM;
+	}
 
 	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			   &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
@@ -1197,13 +1352,12 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_destroy(ev->ev_lock);
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
@@ -1345,6 +1499,7 @@ config_emu(struct emu_softc *sc, int emuno)
 		return ENOMEM;
 	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
+	sc->e_wgen = 0;
 
 	snprintf(name, sizeof(name), "emu%d", emuno);
 
@@ -50,6 +50,7 @@ struct emu_softc {
 	struct lock *e_lock;
 	struct semaphore *e_sem;
 	void *e_iobuf;
+	uint32_t e_wgen;	/* bumped by every write; see emu.c */
 
 	/* Written by the interrupt handler */
 	uint32_t e_result;
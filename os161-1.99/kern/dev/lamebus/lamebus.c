@@ -504,6 +504,8 @@ lamebus_interrupt(struct lamebus_softc *lamebus)
 		data = lamebus->ls_devdata[slot];
 		spinlock_release(&lamebus->ls_lock);
 
+		_cpustat_inc(CPUSTAT_IRQ(slot));
+
 		handler(data);
 
 		spinlock_acquire(&lamebus->ls_lock);
@@ -29,13 +29,33 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The disk transfers one sector at a time through its on-card buffer.
+ * Requests go into a queue kept in sector order, and the interrupt
+ * handler runs the disk from it: when a sector finishes, it copies
+ * the data and starts the next sector of the same request, or picks
+ * the next request and starts that, so the disk never sits idle
+ * waiting for a thread to be scheduled. The thread that made a
+ * request sleeps until the interrupt handler says it's done.
+ *
+ * Requests are picked C-LOOK: the lowest sector at or after the last
+ * one started, or failing that the lowest sector overall. Requests
+ * that are next to each other on disk thus go back to back, with no
+ * seek between them; with one sector per transfer that's all there
+ * is to merging them. So that a stream of requests just ahead of the
+ * head can't starve the rest, a request that has been overtaken by
+ * LHD_MAXSKIPS later ones goes next wherever it is.
+ *
+ * lh_lock protects the queue and the device registers. It's a
+ * spinlock, because the interrupt handler takes it.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +79,28 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most requests that may overtake an earlier one. */
+#define LHD_MAXSKIPS    32
+
+/* Sectors moved through a bounce buffer at a time. */
+#define LHD_BOUNCESECTS 8
+
+/*
+ * A request. It lives on the stack of the thread that made it, which
+ * doesn't return until the interrupt handler has finished with it.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* next sector to transfer */
+	uint32_t lr_nsects;		/* sectors left to transfer */
+	char *lr_data;			/* memory for the next sector */
+	bool lr_write;			/* true if writing */
+	unsigned lr_seq;		/* arrival order */
+	unsigned lr_skips;		/* times overtaken */
+	bool lr_done;			/* finished, one way or the other */
+	int lr_result;			/* errno, once done */
+	struct lhd_request *lr_next;	/* queue, in sector order */
+};
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,15 +137,122 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the disk on the next sector of the active request.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *r = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(r != NULL && r->lr_nsects > 0);
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (r->lr_write) {
+		memcpy(lh->lh_buf, r->lr_data, LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, r->lr_sector);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+	lh->lh_headpos = r->lr_sector;
+}
+
+/*
+ * Take the next request off the queue (see above for which) and
+ * start it, if there is one.
+ */
+static
+void
+lhd_startnext(struct lhd_softc *lh)
+{
+	struct lhd_request **pr, **pick, *r;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_active == NULL);
+
+	if (lh->lh_queue == NULL) {
+		return;
+	}
+
+	/* The request overtaken most, if it has been overtaken enough. */
+	pick = NULL;
+	for (pr = &lh->lh_queue; *pr != NULL; pr = &(*pr)->lr_next) {
+		if ((*pr)->lr_skips >= LHD_MAXSKIPS &&
+		    (pick == NULL || (*pr)->lr_skips > (*pick)->lr_skips)) {
+			pick = pr;
+		}
+	}
+
+	/* Otherwise the first at or after the head, or the first. */
+	if (pick == NULL) {
+		for (pr = &lh->lh_queue; *pr != NULL; pr = &(*pr)->lr_next) {
+			if ((*pr)->lr_sector >= lh->lh_headpos) {
+				pick = pr;
+				break;
+			}
+		}
+	}
+	if (pick == NULL) {
+		pick = &lh->lh_queue;
+	}
+
+	r = *pick;
+	*pick = r->lr_next;
+	r->lr_next = NULL;
+
+	/* Everything that came before it has been overtaken. */
+	for (pr = &lh->lh_queue; *pr != NULL; pr = &(*pr)->lr_next) {
+		if ((*pr)->lr_seq < r->lr_seq) {
+			(*pr)->lr_skips++;
+		}
+	}
+
+	lh->lh_active = r;
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector has completed. Carry on with the request if
+ * there's more of it; otherwise wake up whoever made it and go on to
+ * the next one.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *r = lh->lh_active;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (r == NULL) {
+		/* Nothing was running; spurious. */
+		return;
+	}
+
+	if (err == 0) {
+		/* If reading, transfer the data out of the buffer. */
+		if (!r->lr_write) {
+			memcpy(r->lr_data, lh->lh_buf, LHD_SECTSIZE);
+		}
+		r->lr_sector++;
+		r->lr_data += LHD_SECTSIZE;
+		r->lr_nsects--;
+		if (r->lr_nsects > 0) {
+			lhd_startsector(lh);
+			return;
+		}
+	}
+
+	r->lr_result = err;
+	r->lr_done = true;
+	lh->lh_active = NULL;
+	wchan_wakeall(lh->lh_wchan);
+
+	lhd_startnext(lh);
 }
 
 /*
@@ -116,7 +265,9 @@ lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
-	
+
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -130,6 +281,57 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Transfer NSECTS sectors starting at SECTOR to or from DATA, and
+ * wait until it's done.
+ */
+static
+int
+lhd_submit(struct lhd_softc *lh, uint32_t sector, uint32_t nsects,
+	   char *data, bool write)
+{
+	struct lhd_request r, **pr;
+
+	KASSERT(nsects > 0);
+
+	r.lr_sector = sector;
+	r.lr_nsects = nsects;
+	r.lr_data = data;
+	r.lr_write = write;
+	r.lr_skips = 0;
+	r.lr_done = false;
+	r.lr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	/* Queue it in sector order, after any for the same sector. */
+	r.lr_seq = lh->lh_seq++;
+	for (pr = &lh->lh_queue; *pr != NULL; pr = &(*pr)->lr_next) {
+		if ((*pr)->lr_sector > sector) {
+			break;
+		}
+	}
+	r.lr_next = *pr;
+	*pr = &r;
+
+	if (lh->lh_active == NULL) {
+		lhd_startnext(lh);
+	}
+
+	while (!r.lr_done) {
+		/* Same handoff as in P(). */
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+
+	spinlock_release(&lh->lh_lock);
+	return r.lr_result;
 }
 
 /*
@@ -193,8 +395,44 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * If UIO is in kernel memory and its next iovec holds a whole number
+ * of sectors, return the iovec's address and set *NSECTS to that
+ * number (but no more than MAXSECTS). The interrupt handler can then
+ * copy straight to or from it. If not, return NULL.
+ */
+static
+char *
+lhd_kernrun(struct uio *uio, uint32_t maxsects, uint32_t *nsects)
+{
+	struct iovec *iov;
+	uint32_t n;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return NULL;
+	}
+	/* Skip iovecs that have been used up; see uiomove. */
+	while (uio->uio_iov->iov_len == 0 && uio->uio_iovcnt > 1) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+	}
+	iov = uio->uio_iov;
+	if (iov->iov_len == 0 || iov->iov_len % LHD_SECTSIZE != 0) {
+		return NULL;
+	}
+	n = iov->iov_len / LHD_SECTSIZE;
+	*nsects = n < maxsects ? n : maxsects;
+	return iov->iov_kbase;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Kernel buffers that are whole sectors, which is what the buffer
+ * cache and the SFS journal use (often several to a uio), are handed
+ * to the interrupt handler as they are, one iovec at a time. The rest
+ * goes through a bounce buffer, since the interrupt handler can't
+ * touch user addresses.
  */
 static
 int
@@ -206,8 +444,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	struct iovec *iov;
+	char *bounce, *kbuf;
+	uint32_t n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +460,63 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	bounce = NULL;
+	result = 0;
+	while (len > 0) {
+		kbuf = lhd_kernrun(uio, len, &n);
+		if (kbuf != NULL) {
+			result = lhd_submit(lh, sector, n, kbuf, write);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
+			iov = uio->uio_iov;
+			iov->iov_kbase = kbuf + n * LHD_SECTSIZE;
+			iov->iov_len -= n * LHD_SECTSIZE;
+			uio->uio_resid -= n * LHD_SECTSIZE;
+			uio->uio_offset += n * LHD_SECTSIZE;
+			sector += n;
+			len -= n;
+			continue;
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (bounce == NULL) {
+			bounce = kmalloc(LHD_BOUNCESECTS * LHD_SECTSIZE);
+			if (bounce == NULL) {
+				result = ENOMEM;
+				break;
+			}
 		}
+		n = len < LHD_BOUNCESECTS ? len : LHD_BOUNCESECTS;
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+		if (write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
 
-		/* If we failed, return the error. */
+		result = lhd_submit(lh, sector, n, bounce, write);
 		if (result) {
-			return result;
+			break;
 		}
+
+		if (!write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,17 +533,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_seq = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
@@ -30,8 +30,11 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
+struct lhd_request;	/* private to lhd.c */
+
 /*
  * Our sector size
  */
@@ -51,9 +54,12 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the rest; see lhd.c */
+	struct wchan *lh_wchan;		/* Threads waiting for requests */
+	struct lhd_request *lh_queue;	/* Pending requests */
+	struct lhd_request *lh_active;	/* Request the disk is working on */
+	uint32_t lh_headpos;		/* Last sector started */
+	unsigned lh_seq;		/* Numbers requests in order */
 
 	struct device lh_dev;		/* VFS device structure */
 };
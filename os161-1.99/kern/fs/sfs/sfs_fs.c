@@ -39,27 +39,42 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <workqueue.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
+/* Delay before a background sync, in hardclocks. */
+#define SFS_SYNCDELAY	HZ
+
+/* How many times a failed background sync is tried before giving up. */
+#define SFS_SYNCTRIES	3
+
 /* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
-#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+#define SFS_FS_BITMAPSIZE(sfs) \
+	SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+#define SFS_FS_BITBLOCKS(sfs) \
+	SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads do the whole bitmap at once. Writes do only the bitmap blocks
+ * marked in sfs_freemapdirtymap, and clear those marks; allocating
+ * or freeing a block touches one bit, so on a large volume nearly
+ * all of the bitmap is usually clean.
  *
- * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
- * bits, one bit for each sector on the filesystem. The number of
- * blocks in the bitmap is thus rounded up to the nearest multiple of
- * 512*8 = 4096. (This rounded number is SFS_BITMAPSIZE.) This means
- * that the bitmap will (in general) contain space for some number of
- * invalid sectors that are actually beyond the end of the disk
- * device. This is ok. These sectors are supposed to be marked "in
- * use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_BITBLOCKS blocks of bits, one
+ * bit for each block on the filesystem. The number of blocks in the
+ * bitmap is thus rounded up to the nearest multiple of the number of
+ * bits in a block (4096 for 512-byte blocks). (This rounded number
+ * is SFS_BITMAPSIZE.) This means that the bitmap will (in general)
+ * contain space for some number of invalid blocks that are actually
+ * beyond the end of the disk device. This is ok. These blocks are
+ * supposed to be marked "in use" by mksfs and never get marked
+ * "free".
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
@@ -82,25 +97,127 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* For each sector in the bitmap... */
 	for (j=0; j<mapsize; j++) {
 
+		/* Skip it if writing and it hasn't changed */
+		if (rw == UIO_WRITE &&
+		    !bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+			continue;
+		}
+
 		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
+		void *ptr = bitdata + j*sfs->sfs_blocksize;
 
-		/* and read or write it. The bitmap starts at sector 2. */ 
+		/* and read or write it. The bitmap starts at block 2. */ 
 		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_rblock(sfs, ptr, sfs->sfs_blocksize,
+					    SFS_MAP_LOCATION+j);
 		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_wblock(sfs, ptr, sfs->sfs_blocksize,
+					    SFS_MAP_LOCATION+j);
 		}
 
 		/* If we failed, stop. */
 		if (result) {
 			return result;
 		}
+
+		if (rw == UIO_WRITE) {
+			bitmap_unmark(sfs->sfs_freemapdirtymap, j);
+		}
 	}
 	return 0;
 }
 
+/*
+ * Background sync. Shortly after the freemap or the journal changes,
+ * commit the journal or, without one, copy the freemap into the
+ * buffer cache; the cache's flusher writes it out from there. (Inodes
+ * and directories go into the cache as they change.) This bounds how
+ * much is lost in a crash without making anyone wait for the disk.
+ *
+ * If the journal is busy it tries again later. If it fails, it tries
+ * again a few times and then reports the error and gives up until
+ * the next change, so a disk that has gone bad doesn't keep it going
+ * forever.
+ */
+static
+void
+sfs_syncwork(void *arg)
+{
+	struct sfs_fs *sfs = arg;
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_syncarmed = false;
+	lock_release(sfs->sfs_freemaplock);
+
+	if (sfs->sfs_journal != NULL) {
+		result = sfs_jtrycommit(sfs);
+	}
+	else {
+		lock_acquire(sfs->sfs_freemaplock);
+		result = 0;
+		if (sfs->sfs_freemapdirty) {
+			result = sfs_mapio(sfs, UIO_WRITE);
+			if (result == 0) {
+				sfs->sfs_freemapdirty = false;
+			}
+		}
+		lock_release(sfs->sfs_freemaplock);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (result == 0) {
+		sfs->sfs_syncfails = 0;
+	}
+	else if (result == EAGAIN) {
+		sfs_syncsoon(sfs);
+	}
+	else if (++sfs->sfs_syncfails < SFS_SYNCTRIES) {
+		sfs_syncsoon(sfs);
+	}
+	else {
+		kprintf("sfs: %s: Background sync failed: %s\n",
+			sfs->sfs_super.sp_volname, strerror(result));
+		sfs->sfs_syncfails = 0;
+	}
+	KASSERT(sfs->sfs_syncs > 0);
+	sfs->sfs_syncs--;
+	cv_broadcast(sfs->sfs_synccv, sfs->sfs_freemaplock);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+void
+sfs_syncsoon(struct sfs_fs *sfs)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_syncarmed || sfs->sfs_syncoff) {
+		return;
+	}
+	if (workqueue_queue_delayed(&sfs->sfs_syncjob, SFS_SYNCDELAY)) {
+		/* Not the end of the world; sync will still do it. */
+		return;
+	}
+	sfs->sfs_syncarmed = true;
+	sfs->sfs_syncs++;
+}
+
+void
+sfs_freemap_dirty(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t j;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	j = block / SFS_BLOCKBITS(sfs->sfs_blocksize);
+	if (!bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+		bitmap_mark(sfs->sfs_freemapdirtymap, j);
+	}
+	sfs->sfs_freemapdirty = true;
+	sfs_syncsoon(sfs);
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +228,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	struct vnode **vns;
+	unsigned i, h, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +265,91 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Take a referenced copy of the table of loaded vnodes, and
+	 * sync them with the table unlocked. (VOP_FSYNC takes the
+	 * vnode lock, which comes before sfs_vnlock.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	vns = NULL;
+	if (num > 0) {
+		vns = kmalloc(num * sizeof(*vns));
+		if (vns == NULL) {
+			lock_release(sfs->sfs_vnlock);
+			return ENOMEM;
+		}
+	}
+	i = 0;
+	for (h=0; h<SFS_VNHASH_SIZE; h++) {
+		for (sv = sfs->sfs_vnhash[h]; sv != NULL; sv = sv->sv_hashnext) {
+			KASSERT(i < num);
+			if (sv->sv_loading) {
+				/* Nothing in it to sync yet */
+				continue;
+			}
+			vns[i] = &sv->sv_v;
+			VOP_INCREF(vns[i]);
+			i++;
+		}
+	}
+	num = i;
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		VOP_FSYNC(vns[i]);
+		VOP_DECREF(vns[i]);
 	}
+	kfree(vns);
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+	/*
+	 * With a journal, commit and checkpoint; that takes care of
+	 * the free block map too. Otherwise, if the free block map
+	 * needs to be written, write it.
+	 */
+	if (sfs->sfs_journal != NULL) {
+		result = sfs_jsync(sfs);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
+	}
+	else {
+		lock_acquire(sfs->sfs_freemaplock);
+		if (sfs->sfs_freemapdirty) {
+			result = sfs_mapio(sfs, UIO_WRITE);
+			if (result) {
+				lock_release(sfs->sfs_freemaplock);
+				return result;
+			}
+			sfs->sfs_freemapdirty = false;
+		}
+		lock_release(sfs->sfs_freemaplock);
 	}
 
-	/* If the superblock needs to be written, write it. */
+	/*
+	 * If the superblock needs to be written, write it. (Nothing
+	 * changes the superblock after mount, so no lock.)
+	 */
 	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		result = sfs_wblock(sfs, &sfs->sfs_super,
+				    sizeof(sfs->sfs_super), SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	/*
+	 * Now push everything that's still dirty in the cache out to
+	 * disk. With a journal the checkpoint in sfs_jsync already did
+	 * that, while no operation was in progress; doing it again here
+	 * could catch a metadata block partway through being changed,
+	 * before sfs_jdirty has held it, and write it home unlogged.
+	 */
+	if (sfs->sfs_journal != NULL) {
+		return 0;
+	}
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
@@ -189,13 +362,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* Constant once mounted; no lock needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -209,21 +378,60 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds its device table lock, so nobody can start
+	 * looking things up on this fs while we're here.) Vnodes that
+	 * are only being kept around in case they're wanted again
+	 * don't count.
+	 */
+	sfs_inactive_purge(sfs);
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 
+	/* Let any read-ahead still in progress finish with the cache. */
+	while (sfs->sfs_prefetches > 0) {
+		cv_wait(sfs->sfs_prefetchcv, sfs->sfs_vnlock);
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Cancel the background sync if it's scheduled, and make sure
+	 * it isn't again; if it has already started, let it finish.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_syncoff = true;
+	if (sfs->sfs_syncarmed &&
+	    workqueue_cancel(&sfs->sfs_syncjob) == 0) {
+		sfs->sfs_syncarmed = false;
+		KASSERT(sfs->sfs_syncs > 0);
+		sfs->sfs_syncs--;
+	}
+	while (sfs->sfs_syncs > 0) {
+		cv_wait(sfs->sfs_synccv, sfs->sfs_freemaplock);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_junmount(sfs);
+	bitmap_destroy(sfs->sfs_freemapdirtymap);
+	bitmap_destroy(sfs->sfs_allocmap);
 	bitmap_destroy(sfs->sfs_freemap);
+	cv_destroy(sfs->sfs_synccv);
+	cv_destroy(sfs->sfs_prefetchcv);
+	cv_destroy(sfs->sfs_loadcv);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
+
+	/* Everything was just written back; forget our cached blocks. */
+	buffer_drop_device(sfs->sfs_device);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +440,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -250,14 +457,52 @@ sfs_unmount(struct fs *fs)
  * mounted on the same device at once.
  */
 
+/*
+ * Free an sfs_fs that didn't get all the way through mounting.
+ * Anything not yet allocated is NULL.
+ */
+static
+void
+sfs_fs_destroy(struct sfs_fs *sfs)
+{
+	sfs_junmount(sfs);
+	if (sfs->sfs_freemapdirtymap != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtymap);
+	}
+	if (sfs->sfs_allocmap != NULL) {
+		bitmap_destroy(sfs->sfs_allocmap);
+	}
+	if (sfs->sfs_freemap != NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+	}
+	if (sfs->sfs_freemaplock != NULL) {
+		lock_destroy(sfs->sfs_freemaplock);
+	}
+	if (sfs->sfs_synccv != NULL) {
+		cv_destroy(sfs->sfs_synccv);
+	}
+	if (sfs->sfs_prefetchcv != NULL) {
+		cv_destroy(sfs->sfs_prefetchcv);
+	}
+	if (sfs->sfs_loadcv != NULL) {
+		cv_destroy(sfs->sfs_loadcv);
+	}
+	if (sfs->sfs_vnlock != NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+	}
+	kfree(sfs);
+}
+
 static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	struct iovec iov;
+	struct uio ku;
+	uint32_t bs;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -270,42 +515,71 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors are bigger than our
+	 * smallest block, or don't divide it evenly. (A filesystem
+	 * block may be made of several sectors; the block size is
+	 * checked against the sector size once we've read it.)
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
+	if (dev->d_blocksize > SFS_BLOCKSIZE ||
+	    SFS_BLOCKSIZE % dev->d_blocksize != 0) {
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
-
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		vfs_biglock_release();
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_inacthead = sfs->sfs_inacttail = NULL;
+	sfs->sfs_ninactive = 0;
+	sfs->sfs_vnlock = NULL;
+	sfs->sfs_prefetches = 0;
+	sfs->sfs_prefetchcv = NULL;
+	sfs->sfs_loadcv = NULL;
+	sfs->sfs_freemap = NULL;
+	sfs->sfs_allocmap = NULL;
+	sfs->sfs_freemapdirtymap = NULL;
+	sfs->sfs_freemaplock = NULL;
+	sfs->sfs_syncarmed = false;
+	sfs->sfs_syncoff = false;
+	sfs->sfs_syncfails = 0;
+	sfs->sfs_syncs = 0;
+	sfs->sfs_synccv = NULL;
+	work_init(&sfs->sfs_syncjob, sfs_syncwork, sfs);
+	sfs->sfs_journal = NULL;
+
+	/* Allocate locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	sfs->sfs_prefetchcv = cv_create("sfs_prefetch");
+	sfs->sfs_loadcv = cv_create("sfs_load");
+	sfs->sfs_synccv = cv_create("sfs_sync");
+	if (sfs->sfs_vnlock == NULL || sfs->sfs_freemaplock == NULL ||
+	    sfs->sfs_prefetchcv == NULL || sfs->sfs_loadcv == NULL ||
+	    sfs->sfs_synccv == NULL) {
+		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
 
-	/* Set the device so we can use sfs_rblock() */
+	/* Set the device so we can use sfs_rwblock() */
 	sfs->sfs_device = dev;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
 
-	/* Load superblock */
-	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	/*
+	 * Load superblock. We don't know the block size yet, so read
+	 * just the superblock itself from the device, bypassing the
+	 * cache; from here on block 0 is only accessed through the
+	 * cache at the full block size.
+	 */
+	uio_kinit(&iov, &ku, &sfs->sfs_super, sizeof(sfs->sfs_super),
+		  SFS_SB_LOCATION, UIO_READ);
+	result = sfs_rwblock(sfs, &ku);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
@@ -316,37 +590,79 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if (sfs->sfs_super.sp_version > SFS_VERSION) {
+		kprintf("sfs: Unsupported format version %u "
+			"(this kernel supports up to %u)\n",
+			sfs->sfs_super.sp_version, SFS_VERSION);
+		sfs_fs_destroy(sfs);
 		return EINVAL;
 	}
+
+	/* Volumes before version 2 don't record it; they use 512. */
+	bs = sfs->sfs_super.sp_blocksize;
+	if (bs == 0) {
+		bs = SFS_BLOCKSIZE;
+	}
+	if (bs < SFS_BLOCKSIZE || bs > SFS_MAXBLOCKSIZE ||
+	    (bs & (bs - 1)) != 0 || bs % dev->d_blocksize != 0) {
+		kprintf("sfs: Unsupported block size %u\n", bs);
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+	sfs->sfs_blocksize = bs;
+	sfs->sfs_dbperidb = SFS_DBPERIDB(bs);
 	
-	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_super.sp_nblocks, dev->d_blocks);
+	if ((uint64_t)sfs->sfs_super.sp_nblocks * (bs / dev->d_blocksize)
+	    > dev->d_blocks) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u\n",
+			sfs->sfs_super.sp_nblocks, bs, dev->d_blocks);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/*
+	 * Replay the journal, if there is one, before reading anything
+	 * it might have a newer copy of.
+	 */
+	result = sfs_jmount(sfs);
+	if (result) {
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemapdirtymap = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_freemapdirtymap == NULL) {
+		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
+	/* Nothing is reserved yet, so the allocation map starts the same. */
+	sfs->sfs_allocmap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	if (sfs->sfs_allocmap == NULL) {
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
+	memcpy(bitmap_getdata(sfs->sfs_allocmap),
+	       bitmap_getdata(sfs->sfs_freemap),
+	       SFS_FS_BITMAPSIZE(sfs) / CHAR_BIT);
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -358,10 +674,21 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
 
+	/*
+	 * Older volumes are a subset of the current format; upgrade
+	 * them so the multi-level indirect blocks we may now write
+	 * aren't mistaken for junk by old tools. (They stay without a
+	 * journal; sp_journalblocks was unused space, so it's 0.)
+	 */
+	if (sfs->sfs_super.sp_version < SFS_VERSION) {
+		sfs->sfs_super.sp_version = SFS_VERSION;
+		sfs->sfs_super.sp_blocksize = bs;
+		sfs->sfs_superdirty = true;
+	}
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
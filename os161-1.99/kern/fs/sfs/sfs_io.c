@@ -33,16 +33,24 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Basic block-level I/O routines
 //
-// Note: sfs_rblock is used to read the superblock
+// Note: sfs_rwblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
-// except sfs_device.
+// except sfs_device and sfs_blocksize.
+//
+// Everything goes through the buffer cache except sfs_rwblock,
+// which talks to the device directly. Anyone using sfs_rwblock on a
+// block that might be in the cache must deal with the consequences.
+// The journal (sfs_journal.c) uses it for the journal blocks, which
+// are never cached, and for replay, which happens before anything
+// is.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,11 +58,9 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	      uio->uio_offset / sfs->sfs_blocksize);
 
  retry:
 	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
@@ -70,7 +76,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		if (tries == 0) {
 			tries++;
 			kprintf("sfs: block %llu I/O error, retrying\n",
-				uio->uio_offset / SFS_BLOCKSIZE);
+				uio->uio_offset / sfs->sfs_blocksize);
 			goto retry;
 		}
 		else if (tries < 10) {
@@ -80,28 +86,75 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		else {
 			kprintf("sfs: block %llu I/O error, giving up after "
 				"%d retries\n",
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+				uio->uio_offset / sfs->sfs_blocksize, tries);
 		}
 	}
 	return result;
 }
 
+/*
+ * Get a pinned buffer for BLOCK with its contents.
+ */
 int
-sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
+sfs_bread(struct sfs_fs *sfs, uint32_t block, struct buf **ret)
 {
-	struct iovec iov;
-	struct uio ku;
+	return buffer_read(sfs->sfs_device, block, sfs->sfs_blocksize, ret);
+}
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+/*
+ * Get a pinned buffer for BLOCK that the caller will overwrite
+ * completely.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, uint32_t block, struct buf **ret)
+{
+	return buffer_get(sfs->sfs_device, block, sfs->sfs_blocksize, ret);
 }
 
+/*
+ * Copy the first LEN bytes of BLOCK out of the cache.
+ */
 int
-sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
+sfs_rblock(struct sfs_fs *sfs, void *data, size_t len, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *b;
+	int result;
+
+	KASSERT(len <= sfs->sfs_blocksize);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bread(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(b), len);
+	buffer_release(b);
+	return 0;
+}
+
+/*
+ * Copy LEN bytes of DATA into the cache as the new contents of BLOCK,
+ * zeroing the rest of the block. It is written to disk later.
+ */
+int
+sfs_wblock(struct sfs_fs *sfs, void *data, size_t len, uint32_t block)
+{
+	struct buf *b;
+	char *ptr;
+	int result;
+
+	KASSERT(len <= sfs->sfs_blocksize);
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	ptr = buffer_map(b);
+	memcpy(ptr, data, len);
+	if (len < sfs->sfs_blocksize) {
+		bzero(ptr + len, sfs->sfs_blocksize - len);
+	}
+	buffer_mark_valid(b);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
@@ -0,0 +1,829 @@
+/*
+ * SFS metadata journal.
+ *
+ * See <kern/sfs.h> for the on-disk layout.
+ *
+ * Every operation that changes metadata runs inside a transaction:
+ * it calls sfs_jbegin first and sfs_jend when it's done, and in
+ * between hands each metadata block it changes to sfs_jdirty instead
+ * of just marking the buffer dirty. All the operations in progress at
+ * once share the running transaction, and so does everything that
+ * comes after them until it is committed (group commit), so many
+ * operations cost one journal write.
+ *
+ * A block in the running transaction is held in the buffer cache
+ * (buffer_hold), so its new contents can't reach its home location
+ * before they're in the journal. Committing needs nobody to be in
+ * the middle of an operation, and writes
+ *
+ *    1. every other dirty buffer on the device, so file data never
+ *       lands after metadata that points to it (ordered data);
+ *    2. a descriptor, the transaction's blocks, and a commit block,
+ *       to the journal;
+ *
+ * after which the buffers are let go, to be written home whenever the
+ * cache gets around to it. The freemap lives in memory (sfs_freemap);
+ * if it has changed, commit copies it into its blocks in the cache
+ * and logs those along with the rest.
+ *
+ * A checkpoint empties the journal: it writes everything home and
+ * then rewrites the header so recovery starts after the last
+ * transaction. That happens when there's no room left for another
+ * full transaction, and on sync.
+ *
+ * A block that is freed while the journal still has a copy of it must
+ * not be reused before the next checkpoint, or replaying the old copy
+ * could clobber its new contents. sfs_jfree keeps such blocks marked
+ * in use in memory until then (they are logged as free).
+ *
+ * Half an operation can't be committed, so sfs_jbegin first makes sure
+ * the running transaction has room for another one (SFS_JRESERVE
+ * blocks each), committing it if not. That can mean waiting for
+ * everyone else to call sfs_jend; so sfs_jbegin must be called before
+ * taking any vnode lock, or it could wait for someone who is waiting
+ * for that lock. (sv_iolock is the exception: it's always taken
+ * before sfs_jbegin, so nobody in a transaction waits for it.)
+ *
+ * Locking: j_lock covers everything in struct sfs_journal. It comes
+ * after sfs_vnlock and before sfs_freemaplock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <synch.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+
+struct sfs_jentry {
+	uint32_t je_block;		/* home location */
+	struct buf *je_buf;		/* held buffer */
+};
+
+struct sfs_journal {
+	struct lock *j_lock;		/* see above */
+	struct cv *j_cv;		/* sfs_jbegin waits here */
+	uint32_t j_start;		/* first journal block (the header) */
+	uint32_t j_size;		/* number of journal blocks */
+	uint32_t j_pos;			/* where the next transaction goes */
+	uint32_t j_seq;			/* running transaction's number */
+	unsigned j_max;			/* most blocks in a transaction */
+	unsigned j_fmblocks;		/* blocks in the freemap */
+	unsigned j_users;		/* operations in progress */
+	bool j_commitwanted;		/* someone is waiting to commit */
+
+	struct sfs_jentry *j_txn;	/* running transaction (j_max) */
+	unsigned j_ntxn;
+	uint32_t *j_logged;		/* logged since checkpoint (j_size) */
+	unsigned j_nlogged;
+	uint32_t *j_deferred;		/* frees waiting for checkpoint */
+	unsigned j_ndeferred;
+
+	void *j_block;			/* one block of scratch space */
+	struct iovec *j_iov;		/* for writing out a transaction */
+};
+
+/*
+ * Read or write one journal block, bypassing the cache. Nothing else
+ * uses these blocks.
+ */
+static
+int
+sfs_jrw(struct sfs_fs *sfs, uint32_t block, void *data, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	SFSUIO(sfs, &iov, &ku, data, block, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Write the journal header, saying recovery should start with
+ * transaction SEQ. DATA is a block of scratch space.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, uint32_t seq, void *data)
+{
+	struct sfs_jblock *jb = data;
+
+	bzero(data, sfs->sfs_blocksize);
+	jb->jb_magic = SFS_JMAGIC;
+	jb->jb_seq = seq;
+	return sfs_jrw(sfs, sfs->sfs_super.sp_journalstart, data, UIO_WRITE);
+}
+
+/*
+ * Recovery. Copy each committed transaction's blocks home, in order,
+ * and hand back the sequence number of the first one that wasn't
+ * committed. DESC and DATA are blocks of scratch space.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, void *desc, void *data, uint32_t *seqret)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_jblock *jb = desc;
+	struct sfs_jblock *cb = data;
+	uint32_t start, size, pos, seq, count, home, i;
+	unsigned ntxns;
+	int result;
+
+	start = sp->sp_journalstart;
+	size = sp->sp_journalblocks;
+
+	result = sfs_jrw(sfs, start, desc, UIO_READ);
+	if (result) {
+		return result;
+	}
+	if (jb->jb_magic != SFS_JMAGIC) {
+		kprintf("sfs: %s: Bad journal header\n", sp->sp_volname);
+		return EINVAL;
+	}
+	seq = jb->jb_seq;
+
+	ntxns = 0;
+	pos = 1;
+	while (pos + 2 <= size) {
+		result = sfs_jrw(sfs, start + pos, desc, UIO_READ);
+		if (result) {
+			return result;
+		}
+		count = jb->jb_count;
+		if (jb->jb_magic != SFS_JDESCMAGIC || jb->jb_seq != seq ||
+		    count > SFS_JMAXBLOCKS || pos + count + 2 > size) {
+			break;
+		}
+
+		/* Only replay it if it was committed. */
+		result = sfs_jrw(sfs, start + pos + 1 + count, data,
+				 UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (cb->jb_magic != SFS_JCOMMITMAGIC || cb->jb_seq != seq) {
+			break;
+		}
+
+		for (i=0; i<count; i++) {
+			home = jb->jb_blocks[i];
+			if (home == SFS_SB_LOCATION ||
+			    home >= sp->sp_nblocks ||
+			    (home >= start && home < start + size)) {
+				kprintf("sfs: %s: Bad block %u in journal\n",
+					sp->sp_volname, home);
+				return EINVAL;
+			}
+			result = sfs_jrw(sfs, start + pos + 1 + i, data,
+					 UIO_READ);
+			if (result) {
+				return result;
+			}
+			result = sfs_jrw(sfs, home, data, UIO_WRITE);
+			if (result) {
+				return result;
+			}
+		}
+
+		ntxns++;
+		pos += count + 2;
+		seq++;
+	}
+
+	if (ntxns > 0) {
+		kprintf("sfs: %s: Replayed %u journal transactions\n",
+			sp->sp_volname, ntxns);
+	}
+	*seqret = seq;
+	return 0;
+}
+
+/*
+ * Free a journal structure. Anything not yet allocated is NULL.
+ */
+static
+void
+sfs_jdestroy(struct sfs_journal *j)
+{
+	if (j->j_iov != NULL) {
+		kfree(j->j_iov);
+	}
+	if (j->j_block != NULL) {
+		kfree(j->j_block);
+	}
+	if (j->j_deferred != NULL) {
+		kfree(j->j_deferred);
+	}
+	if (j->j_logged != NULL) {
+		kfree(j->j_logged);
+	}
+	if (j->j_txn != NULL) {
+		kfree(j->j_txn);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j);
+}
+
+/*
+ * Set up the journal at mount time, replaying whatever was committed
+ * but not checkpointed. Called before the freemap is loaded and before
+ * anything goes through the buffer cache. Leaves sfs_journal NULL if
+ * the volume has no journal.
+ */
+int
+sfs_jmount(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_journal *j;
+	uint32_t bs, mapend, seq;
+	void *data;
+	int result;
+
+	sfs->sfs_journal = NULL;
+	if (sp->sp_journalblocks == 0) {
+		return 0;
+	}
+
+	bs = sfs->sfs_blocksize;
+	mapend = SFS_MAP_LOCATION + SFS_BITBLOCKS(sp->sp_nblocks, bs);
+	if (sp->sp_journalstart < mapend ||
+	    sp->sp_journalblocks > sp->sp_nblocks ||
+	    sp->sp_journalstart > sp->sp_nblocks - sp->sp_journalblocks) {
+		kprintf("sfs: %s: Bad journal location\n", sp->sp_volname);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_lock = NULL;
+	j->j_cv = NULL;
+	j->j_txn = NULL;
+	j->j_logged = NULL;
+	j->j_deferred = NULL;
+	j->j_block = NULL;
+	j->j_iov = NULL;
+
+	j->j_start = sp->sp_journalstart;
+	j->j_size = sp->sp_journalblocks;
+	j->j_fmblocks = SFS_BITBLOCKS(sp->sp_nblocks, bs);
+	j->j_users = 0;
+	j->j_commitwanted = false;
+	j->j_ntxn = 0;
+	j->j_nlogged = 0;
+	j->j_ndeferred = 0;
+
+	/*
+	 * A transaction must fit in the journal after the header, with
+	 * its descriptor and commit block; and it must have room for
+	 * the freemap plus at least one operation. (SFS_JMAXBYTES also
+	 * keeps it to half the buffer cache, since it's held there.)
+	 */
+	KASSERT(SFS_JMAXBYTES <= BUF_MAXBYTES / 2);
+	j->j_max = SFS_JMAXBLOCKS;
+	if (j->j_max > SFS_JMAXBYTES / bs) {
+		j->j_max = SFS_JMAXBYTES / bs;
+	}
+	if (j->j_size < 3) {
+		j->j_max = 0;
+	}
+	else if (j->j_max > j->j_size - 3) {
+		j->j_max = j->j_size - 3;
+	}
+	if (j->j_max < j->j_fmblocks + SFS_JRESERVE) {
+		kprintf("sfs: %s: Journal too small\n", sp->sp_volname);
+		sfs_jdestroy(j);
+		return EINVAL;
+	}
+
+	j->j_lock = lock_create("sfs_journal");
+	j->j_cv = cv_create("sfs_journal");
+	j->j_txn = kmalloc(j->j_max * sizeof(*j->j_txn));
+	j->j_logged = kmalloc(j->j_size * sizeof(*j->j_logged));
+	j->j_deferred = kmalloc(j->j_size * sizeof(*j->j_deferred));
+	j->j_block = kmalloc(bs);
+	j->j_iov = kmalloc((j->j_max + 1) * sizeof(*j->j_iov));
+	if (j->j_lock == NULL || j->j_cv == NULL || j->j_txn == NULL ||
+	    j->j_logged == NULL || j->j_deferred == NULL ||
+	    j->j_block == NULL || j->j_iov == NULL) {
+		sfs_jdestroy(j);
+		return ENOMEM;
+	}
+
+	data = kmalloc(bs);
+	if (data == NULL) {
+		sfs_jdestroy(j);
+		return ENOMEM;
+	}
+	result = sfs_jreplay(sfs, j->j_block, data, &seq);
+	kfree(data);
+	if (result) {
+		sfs_jdestroy(j);
+		return result;
+	}
+
+	/*
+	 * Start over with an empty journal. Skip a sequence number, so
+	 * a stale transaction left after the last one replayed can't
+	 * be taken for the first new one.
+	 */
+	seq++;
+	result = sfs_jwriteheader(sfs, seq, j->j_block);
+	if (result) {
+		sfs_jdestroy(j);
+		return result;
+	}
+	j->j_seq = seq;
+	j->j_pos = 1;
+
+	sfs->sfs_journal = j;
+	return 0;
+}
+
+/*
+ * Tear down the journal at unmount (or on a failed mount). Everything
+ * should have been checkpointed already by sfs_jsync.
+ */
+void
+sfs_junmount(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_users == 0);
+	KASSERT(j->j_ntxn == 0);
+	sfs_jdestroy(j);
+	sfs->sfs_journal = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Transactions
+
+/*
+ * Add B, which holds block BLOCK, to the running transaction if it
+ * isn't already there.
+ */
+static
+void
+sfs_jadd(struct sfs_journal *j, struct buf *b, uint32_t block)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	for (i=0; i<j->j_ntxn; i++) {
+		if (j->j_txn[i].je_block == block) {
+			KASSERT(j->j_txn[i].je_buf == b);
+			return;
+		}
+	}
+	KASSERT(j->j_ntxn < j->j_max);
+	buffer_hold(b);
+	j->j_txn[j->j_ntxn].je_block = block;
+	j->j_txn[j->j_ntxn].je_buf = b;
+	j->j_ntxn++;
+}
+
+/*
+ * Check if there's room in the running transaction for one more
+ * operation, on top of the ones in progress and the freemap.
+ */
+static
+bool
+sfs_jroom(struct sfs_journal *j)
+{
+	return j->j_ntxn + j->j_fmblocks + (j->j_users + 1) * SFS_JRESERVE
+		<= j->j_max;
+}
+
+/*
+ * Copy the freemap blocks that have changed into the cache and add
+ * them to the running transaction. Blocks whose freeing is
+ * deferred go to disk as free. (The bitmap is stored a byte at a time,
+ * lowest-numbered block in the low bit; see bitmap.c.)
+ */
+static
+int
+sfs_jfreemap(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct buf *b;
+	char *bitdata;
+	unsigned char *ptr;
+	uint32_t i, k, bit, bitsperblock;
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (!sfs->sfs_freemapdirty) {
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+
+	bitdata = bitmap_getdata(sfs->sfs_freemap);
+	bitsperblock = SFS_BLOCKBITS(sfs->sfs_blocksize);
+	for (i=0; i<j->j_fmblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_freemapdirtymap, i)) {
+			continue;
+		}
+		result = sfs_bget(sfs, SFS_MAP_LOCATION + i, &b);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		ptr = buffer_map(b);
+		memcpy(ptr, bitdata + i * sfs->sfs_blocksize,
+		       sfs->sfs_blocksize);
+		for (k=0; k<j->j_ndeferred; k++) {
+			if (j->j_deferred[k] / bitsperblock != i) {
+				continue;
+			}
+			bit = j->j_deferred[k] % bitsperblock;
+			ptr[bit / CHAR_BIT] &= ~(1 << (bit % CHAR_BIT));
+		}
+		buffer_mark_valid(b);
+		sfs_jadd(j, b, SFS_MAP_LOCATION + i);
+		buffer_mark_dirty(b);
+		buffer_release(b);
+		bitmap_unmark(sfs->sfs_freemapdirtymap, i);
+	}
+	sfs->sfs_freemapdirty = false;
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
+/*
+ * Write the running transaction to the journal: the descriptor and
+ * the blocks in one transfer, then the commit block.
+ */
+static
+int
+sfs_jwritetxn(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jblock *jb = j->j_block;
+	uint32_t bs = sfs->sfs_blocksize;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	bzero(j->j_block, bs);
+	jb->jb_magic = SFS_JDESCMAGIC;
+	jb->jb_seq = j->j_seq;
+	jb->jb_count = j->j_ntxn;
+	j->j_iov[0].iov_kbase = j->j_block;
+	j->j_iov[0].iov_len = bs;
+	for (i=0; i<j->j_ntxn; i++) {
+		jb->jb_blocks[i] = j->j_txn[i].je_block;
+		j->j_iov[i+1].iov_kbase = buffer_map(j->j_txn[i].je_buf);
+		j->j_iov[i+1].iov_len = bs;
+	}
+
+	ku.uio_iov = j->j_iov;
+	ku.uio_iovcnt = j->j_ntxn + 1;
+	ku.uio_offset = (off_t)(j->j_start + j->j_pos) * bs;
+	ku.uio_resid = (j->j_ntxn + 1) * bs;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+	result = sfs_rwblock(sfs, &ku);
+	if (result) {
+		return result;
+	}
+
+	bzero(j->j_block, bs);
+	jb->jb_magic = SFS_JCOMMITMAGIC;
+	jb->jb_seq = j->j_seq;
+	jb->jb_count = j->j_ntxn;
+	return sfs_jrw(sfs, j->j_start + j->j_pos + 1 + j->j_ntxn,
+		       j->j_block, UIO_WRITE);
+}
+
+/*
+ * Checkpoint: write everything home and empty the journal. Then the
+ * deferred frees can really happen. The running transaction must be
+ * empty.
+ */
+static
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_ntxn == 0);
+
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	result = sfs_jwriteheader(sfs, j->j_seq, j->j_block);
+	if (result) {
+		return result;
+	}
+	j->j_pos = 1;
+	j->j_nlogged = 0;
+
+	if (j->j_ndeferred > 0) {
+		lock_acquire(sfs->sfs_freemaplock);
+		for (i=0; i<j->j_ndeferred; i++) {
+			bitmap_unmark(sfs->sfs_freemap, j->j_deferred[i]);
+			bitmap_unmark(sfs->sfs_allocmap, j->j_deferred[i]);
+			sfs_freemap_dirty(sfs, j->j_deferred[i]);
+		}
+		lock_release(sfs->sfs_freemaplock);
+		j->j_ndeferred = 0;
+	}
+	return 0;
+}
+
+/*
+ * Commit the running transaction. j_lock must be held, and there must
+ * be no operations in progress.
+ */
+static
+int
+sfs_jcommit_locked(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jentry *je;
+	unsigned i, k;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_users == 0);
+
+	result = sfs_jfreemap(sfs);
+	if (result) {
+		return result;
+	}
+	if (j->j_ntxn == 0) {
+		return 0;
+	}
+	KASSERT(j->j_ntxn <= j->j_max);
+	KASSERT(j->j_pos + j->j_ntxn + 2 <= j->j_size);
+
+	/* Data first. This skips the held metadata blocks. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_jwritetxn(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Committed. Let the blocks go home. */
+	for (i=0; i<j->j_ntxn; i++) {
+		je = &j->j_txn[i];
+		for (k=0; k<j->j_nlogged; k++) {
+			if (j->j_logged[k] == je->je_block) {
+				break;
+			}
+		}
+		if (k == j->j_nlogged) {
+			KASSERT(j->j_nlogged < j->j_size);
+			j->j_logged[j->j_nlogged++] = je->je_block;
+		}
+		buffer_unhold(je->je_buf);
+	}
+	j->j_pos += j->j_ntxn + 2;
+	j->j_ntxn = 0;
+	j->j_seq++;
+
+	/* Make sure the next transaction will fit. */
+	if (j->j_pos + j->j_max + 2 > j->j_size) {
+		return sfs_jcheckpoint(sfs);
+	}
+	return 0;
+}
+
+/*
+ * Wait for operations in progress to finish, then commit. Leaves
+ * j_lock held.
+ */
+static
+int
+sfs_jcommit_wait(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	lock_acquire(j->j_lock);
+	while (j->j_users > 0) {
+		j->j_commitwanted = true;
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	result = sfs_jcommit_locked(sfs);
+	j->j_commitwanted = false;
+	cv_broadcast(j->j_cv, j->j_lock);
+	return result;
+}
+
+/*
+ * Start an operation. Must be called before taking any vnode lock
+ * but sv_iolock.
+ */
+int
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_commitwanted || !sfs_jroom(j)) {
+		if (j->j_users > 0) {
+			j->j_commitwanted = true;
+			cv_wait(j->j_cv, j->j_lock);
+			continue;
+		}
+		result = sfs_jcommit_locked(sfs);
+		j->j_commitwanted = false;
+		cv_broadcast(j->j_cv, j->j_lock);
+		if (result) {
+			lock_release(j->j_lock);
+			return result;
+		}
+	}
+	j->j_users++;
+	lock_release(j->j_lock);
+	return 0;
+}
+
+/*
+ * Finish an operation.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_users > 0);
+	j->j_users--;
+	if (j->j_users == 0 && j->j_commitwanted) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	if (j->j_ntxn > 0) {
+		/* Make sure it gets committed before long. */
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_syncsoon(sfs);
+		lock_release(sfs->sfs_freemaplock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Mark a metadata buffer B, holding block BLOCK, dirty. Call it after
+ * changing the contents, with the buffer still pinned, between
+ * sfs_jbegin and sfs_jend. Without a journal this is just
+ * buffer_mark_dirty.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *b, uint32_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j != NULL) {
+		/* Hold it first so it can't be written back early. */
+		lock_acquire(j->j_lock);
+		KASSERT(j->j_users > 0);
+		sfs_jadd(j, b, block);
+		lock_release(j->j_lock);
+	}
+	buffer_mark_dirty(b);
+}
+
+/*
+ * Called when BLOCK is being freed, before its buffer is dropped.
+ * Takes it out of the running transaction. Returns true if the
+ * journal still has a copy of it, in which case the caller should
+ * leave it marked in use; it will be freed at the next checkpoint.
+ */
+bool
+sfs_jfree(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool deferred;
+	unsigned i;
+
+	if (j == NULL) {
+		return false;
+	}
+
+	lock_acquire(j->j_lock);
+	for (i=0; i<j->j_ntxn; i++) {
+		if (j->j_txn[i].je_block == block) {
+			buffer_unhold(j->j_txn[i].je_buf);
+			j->j_txn[i] = j->j_txn[--j->j_ntxn];
+			break;
+		}
+	}
+
+	deferred = false;
+	for (i=0; i<j->j_nlogged; i++) {
+		if (j->j_logged[i] == block) {
+			KASSERT(j->j_ndeferred < j->j_size);
+			j->j_deferred[j->j_ndeferred++] = block;
+			deferred = true;
+			break;
+		}
+	}
+	lock_release(j->j_lock);
+	return deferred;
+}
+
+/*
+ * Commit the running transaction now, e.g. for fsync. Must not be
+ * called inside a transaction.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+	result = sfs_jcommit_wait(sfs);
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * Commit the running transaction if nothing is in progress, for the
+ * background sync. Fails with EAGAIN if something is.
+ */
+int
+sfs_jtrycommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	if (j->j_users > 0) {
+		lock_release(j->j_lock);
+		return EAGAIN;
+	}
+	result = sfs_jcommit_locked(sfs);
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * Commit and checkpoint, for sync and unmount. Applying the deferred
+ * frees dirties the freemap again, so that takes a second round.
+ */
+int
+sfs_jsync(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool again;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	result = sfs_jcommit_wait(sfs);
+	if (result == 0) {
+		again = j->j_ndeferred > 0;
+		result = sfs_jcheckpoint(sfs);
+		if (result == 0 && again) {
+			result = sfs_jcommit_locked(sfs);
+			if (result == 0) {
+				result = sfs_jcheckpoint(sfs);
+			}
+		}
+	}
+	lock_release(j->j_lock);
+	return result;
+}
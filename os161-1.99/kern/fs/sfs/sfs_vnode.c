@@ -43,12 +43,17 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <workqueue.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down */
+static int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,45 +63,100 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = sfs_bget(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), sfs->sfs_blocksize);
+	buffer_mark_valid(b);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back out to disk (that is, to the
+ * cache, and through the journal if there is one).
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
+	char *ptr;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		result = sfs_bget(sfs, sv->sv_ino, &b);
 		if (result) {
 			return result;
 		}
+		ptr = buffer_map(b);
+		memcpy(ptr, &sv->sv_i, sizeof(sv->sv_i));
+		bzero(ptr + sizeof(sv->sv_i),
+		      sfs->sfs_blocksize - sizeof(sv->sv_i));
+		buffer_mark_valid(b);
+		sfs_jdirty(sfs, b, sv->sv_ino);
+		buffer_release(b);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+/*
+ * Mark a buffer holding block DISKBLOCK of file SV dirty. Directory
+ * contents are metadata, and go through the journal.
+ */
+static
+void
+sfs_dirtyblock(struct sfs_vnode *sv, struct buf *b, uint32_t diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_jdirty(sfs, b, diskblock);
+	}
+	else {
+		buffer_mark_dirty(b);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
 
 /*
- * Allocate a block.
+ * Number of blocks to reserve, past the one asked for, when a file
+ * grows at its end.
+ */
+#define SFS_PREALLOC 8
+
+/*
+ * Allocate a block, preferring the first free one at or after HINT.
+ * Blocks reserved for other files (see sfs_balloc_file) don't count
+ * as free.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t hint, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_allocmap, hint, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	bitmap_mark(sfs->sfs_freemap, *diskblock);
+	sfs_freemap_dirty(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -107,14 +167,115 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Free a block. Any cached copy is now garbage, so throw it away
+ * rather than let it be written back. If the journal still has an
+ * old copy of it, it stays in use until the journal lets go of it;
+ * but its bitmap block still counts as changed, because the copy of
+ * the freemap the journal logs shows it free.
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	bool deferred;
+
+	deferred = sfs_jfree(sfs, diskblock);
+	buffer_drop(sfs->sfs_device, diskblock, sfs->sfs_blocksize);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (!deferred) {
+		bitmap_unmark(sfs->sfs_freemap, diskblock);
+		bitmap_unmark(sfs->sfs_allocmap, diskblock);
+	}
+	sfs_freemap_dirty(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a block for file SV. It goes right after the last block
+ * we allocated for the file if possible, so the file stays
+ * contiguous on disk.
+ *
+ * If APPEND is set the file is growing at its end, and we set aside
+ * the next few free blocks after the new one for it too. They are
+ * marked in the allocation map so other files growing at the same
+ * time don't interleave with this one, and are handed out by later
+ * calls, or given back by sfs_prealloc_release when the file is
+ * truncated or goes out of memory. Only a block that is handed out
+ * is marked in the freemap, so the reservation never reaches the
+ * disk and a crash can't leak it.
+ */
+static
+int
+sfs_balloc_file(struct sfs_vnode *sv, bool append, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t block, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (append && sv->sv_npreallocs > 0) {
+		/* Use up the reservation. */
+		block = sv->sv_prealloc;
+		lock_acquire(sfs->sfs_freemaplock);
+		KASSERT(bitmap_isset(sfs->sfs_allocmap, block));
+		bitmap_mark(sfs->sfs_freemap, block);
+		sfs_freemap_dirty(sfs, block);
+		lock_release(sfs->sfs_freemaplock);
+		result = sfs_clearblock(sfs, block);
+		if (result) {
+			return result;
+		}
+		sv->sv_prealloc++;
+		sv->sv_npreallocs--;
+	}
+	else {
+		result = sfs_balloc(sfs, sv->sv_nextalloc, &block);
+		if (result) {
+			return result;
+		}
+		if (append) {
+			KASSERT(sv->sv_npreallocs == 0);
+			lock_acquire(sfs->sfs_freemaplock);
+			for (n = 0; n < SFS_PREALLOC; n++) {
+				if (block + 1 + n >= sfs->sfs_super.sp_nblocks
+				    || bitmap_isset(sfs->sfs_allocmap,
+						    block + 1 + n)) {
+					break;
+				}
+				bitmap_mark(sfs->sfs_allocmap, block + 1 + n);
+			}
+			lock_release(sfs->sfs_freemaplock);
+			sv->sv_prealloc = block + 1;
+			sv->sv_npreallocs = n;
+		}
+	}
+
+	sv->sv_nextalloc = block + 1;
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Give back any blocks reserved by sfs_balloc_file that weren't used.
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* They were never really allocated, so there's nothing to log. */
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sv->sv_npreallocs > 0) {
+		sv->sv_npreallocs--;
+		bitmap_unmark(sfs->sfs_allocmap,
+			      sv->sv_prealloc + sv->sv_npreallocs);
+	}
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,17 +285,45 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Levels of indirection past the direct blocks: the inode has one
+ * singly, one doubly, and one triply indirect block.
+ */
+#define SFS_NINDIRECT_LEVELS 3
+
+/*
+ * Get a pointer to the inode's top-level indirect block of the given
+ * level (1-3).
+ */
+static
+uint32_t *
+sfs_indirect_ptr(struct sfs_vnode *sv, unsigned level)
+{
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: Invalid indirection level %u\n", level);
+	return NULL;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +335,42 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *idptr;
 	uint32_t block;
 	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idoff, span;
+	unsigned level;
+	bool append;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(sfs->sfs_dbperidb * sizeof(uint32_t) == sfs->sfs_blocksize);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (doalloc) {
+		/* Are we extending the file, or filling in a hole? */
+		append = fileblock >= DIVROUNDUP(sv->sv_i.sfi_size,
+						 sfs->sfs_blocksize);
+
+		/*
+		 * If this is the first allocation since the vnode was
+		 * loaded, start looking just past the block before
+		 * this one, or else just past the inode.
+		 */
+		if (sv->sv_nextalloc == 0) {
+			sv->sv_nextalloc = sv->sv_ino + 1;
+			if (fileblock > 0 &&
+			    sfs_bmap(sv, fileblock - 1, 0, &block) == 0 &&
+			    block != 0) {
+				sv->sv_nextalloc = block + 1;
+			}
+		}
+	}
+	else {
+		append = false;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +385,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, append, &block);
 			if (result) {
 				return result;
 			}
@@ -198,27 +407,30 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block; it must be under one of the
+	 * indirect blocks. Subtract off the number of direct blocks,
+	 * and then the size of each level of indirection in turn,
+	 * until FILEBLOCK is an offset within the space mapped by the
+	 * top-level indirect block at LEVEL. SPAN is the number of
+	 * file blocks each entry in that block maps.
 	 */
-
 	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	span = 1;
+	for (level = 1; level <= SFS_NINDIRECT_LEVELS; level++) {
+		if (fileblock < span * sfs->sfs_dbperidb) {
+			break;
+		}
+		fileblock -= span * sfs->sfs_dbperidb;
+		span *= sfs->sfs_dbperidb;
+	}
+	if (level > SFS_NINDIRECT_LEVELS) {
+		/* Past the largest file we can represent. */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top-level indirect block. */
+	idptr = sfs_indirect_ptr(sv, level);
+	idblock = *idptr;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -234,56 +446,71 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * There's no indirect block allocated, but we need to
 		 * allocate a block whose number needs to be stored in
 		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * indirect block. (sfs_balloc_file leaves it zeroed in the
+		 * buffer cache, so loading it below costs nothing.)
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc_file(sv, append, &idblock);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*idptr = idblock;
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+
+	/*
+	 * Walk down through the levels of indirect blocks, allocating
+	 * any that are missing if we're supposed to. The indirect
+	 * blocks stay in the buffer cache, so a sequential pass over
+	 * a large file mostly finds them there.
+	 */
+	while (1) {
+		/* Load the indirect block. */
+		result = sfs_bread(sfs, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
-	}
+		iddata = buffer_map(idbuf);
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+		/* Get the next block out of the indirect block buffer */
+		idoff = fileblock / span;
+		fileblock %= span;
+		block = iddata[idoff];
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
-		}
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			result = sfs_balloc_file(sv, append, &block);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+			/* Remember the block we allocated */
+			iddata[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+			/* The indirect block is now dirty */
+			sfs_jdirty(sfs, idbuf, idblock);
+		}
+		buffer_release(idbuf);
+
+		if (block == 0 || span == 1) {
+			/* A hole, or the data block itself */
+			break;
 		}
+
+		/* Go down a level */
+		idblock = block;
+		span /= sfs->sfs_dbperidb;
 	}
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
+		panic("sfs: Data block %u (offset %u in level %u indirect "
+		      "space of file %u) marked free\n",
+		      block, fileblock, level, sv->sv_ino);
 	}
 	*diskblock = block;
 	return 0;
@@ -308,16 +535,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -325,10 +545,10 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	int doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Get the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -339,40 +559,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuf);
+
+	/*
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove(ioptr+skipstart, len, uio);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer is now dirty. (Even if uiomove
+	 * failed, it may have changed part of it.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_dirtyblock(sv, iobuf, diskblock);
 	}
+	buffer_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,17 +599,14 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Look up the disk block number */
 	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
@@ -409,37 +622,108 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(sfs->sfs_blocksize, uio);
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Get the block from the buffer cache. If we're writing, the
+	 * whole block is about to be overwritten, so don't bother
+	 * reading it in first.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= sfs->sfs_blocksize);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_bread(sfs, diskblock, &iobuf);
+	}
+	else {
+		result = sfs_bget(sfs, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	result = uiomove(buffer_map(iobuf), sfs->sfs_blocksize, uio);
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (uio->uio_rw == UIO_WRITE) {
+		/*
+		 * If the buffer wasn't loaded and uiomove failed,
+		 * it holds junk; leave it invalid. Otherwise it's
+		 * (at least partly) new data.
+		 */
+		if (result == 0 && !buffer_is_valid(iobuf)) {
+			buffer_mark_valid(iobuf);
+		}
+		if (buffer_is_valid(iobuf)) {
+			sfs_dirtyblock(sv, iobuf, diskblock);
+		}
+	}
+	buffer_release(iobuf);
 
 	return result;
 }
 
+/*
+ * Read whole blocks, up to MAXBLOCKS of them, starting at a block
+ * boundary. As many of them as are laid out one after another on
+ * disk are fetched together, so the device sees one transfer instead
+ * of one per block. Sets *DONE to the number of blocks read.
+ */
+static
+int
+sfs_readrun(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks,
+	    uint32_t *done)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *bufs[BUF_MAXRUN];
+	uint32_t fileblock, diskblock, nextblock;
+	unsigned i, n;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(maxblocks > 0);
+
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		/* Hole; this is one block's worth of zeros. */
+		*done = 1;
+		return uiomovezeros(sfs->sfs_blocksize, uio);
+	}
+
+	/* See how far the run goes. */
+	if (maxblocks > BUF_MAXRUN) {
+		maxblocks = BUF_MAXRUN;
+	}
+	for (n=1; n<maxblocks; n++) {
+		result = sfs_bmap(sv, fileblock + n, 0, &nextblock);
+		if (result) {
+			return result;
+		}
+		if (nextblock != diskblock + n) {
+			break;
+		}
+	}
+
+	/* This may give us less than we asked for. */
+	result = buffer_readrun(sfs->sfs_device, diskblock,
+				sfs->sfs_blocksize, &n, bufs);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			result = uiomove(buffer_map(bufs[i]),
+					 sfs->sfs_blocksize, uio);
+		}
+		buffer_release(bufs[i]);
+	}
+	*done = n;
+	return result;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -447,11 +731,14 @@ static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, done;
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -473,16 +760,25 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * If writing, the file size has to fit in sfi_size. (With
+	 * larger blocks the indirect blocks could map more than that.)
+	 */
+	if (uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + uio->uio_resid > (off_t)0xffffffff) {
+		return EFBIG;
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % sfs->sfs_blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -503,20 +799,30 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Reads go a run of blocks at a time; writes only fill the
+	 * cache, and adjacent blocks are written back together later.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	KASSERT(uio->uio_offset % sfs->sfs_blocksize == 0);
+	nblocks = uio->uio_resid / sfs->sfs_blocksize;
+	while (nblocks > 0) {
+		if (uio->uio_rw == UIO_READ) {
+			result = sfs_readrun(sv, uio, nblocks, &done);
+		}
+		else {
+			result = sfs_blockio(sv, uio);
+			done = 1;
+		}
 		if (result) {
 			goto out;
 		}
+		KASSERT(done <= nblocks);
+		nblocks -= done;
 	}
 
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -543,42 +849,206 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
 ////////////////////////////////////////////////////////////
 //
-// Directory I/O
+// Read-ahead
+//
+// Each vnode remembers where the last read left off. A read that
+// starts there is taken as part of a sequential scan, and the blocks
+// after it are fetched into the buffer cache in the background by
+// the work queue, so that by the time the reader gets to them they
+// are (or are on their way to being) in memory. The window starts
+// small and doubles each time the reader catches up with it; a read
+// anywhere else closes it again.
+//
+// Prefetching only touches the buffer cache, never the vnode, so a
+// request may safely outlive the vnode that issued it. Unmount waits
+// for outstanding requests to finish.
+
+/* Read-ahead window limits, in blocks... */
+#define SFS_RA_MINWINDOW 4
+#define SFS_RA_MAXWINDOW 32
+/* ...and never more than this much of the buffer cache. */
+#define SFS_RA_MAXBYTES (BUF_MAXBYTES / 4)
+
+struct sfs_prefetch {
+	struct sfs_fs *pf_sfs;		/* filesystem */
+	uint32_t pf_block;		/* first disk block */
+	unsigned pf_nblocks;		/* length of run */
+};
+
+/*
+ * Work queue function: load one run of blocks into the cache.
+ * Errors are ignored; the reader will hit them again itself.
+ */
+static
+void
+sfs_prefetch_work(void *arg)
+{
+	struct sfs_prefetch *pf = arg;
+	struct sfs_fs *sfs = pf->pf_sfs;
+	struct buf *bufs[BUF_MAXRUN];
+	unsigned i, n;
+
+	n = pf->pf_nblocks;
+	if (buffer_readrun(sfs->sfs_device, pf->pf_block, sfs->sfs_blocksize,
+			   &n, bufs) == 0) {
+		for (i=0; i<n; i++) {
+			buffer_release(bufs[i]);
+		}
+	}
+	kfree(pf);
+
+	lock_acquire(sfs->sfs_vnlock);
+	KASSERT(sfs->sfs_prefetches > 0);
+	sfs->sfs_prefetches--;
+	if (sfs->sfs_prefetches == 0) {
+		cv_broadcast(sfs->sfs_prefetchcv, sfs->sfs_vnlock);
+	}
+	lock_release(sfs->sfs_vnlock);
+}
 
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Queue a prefetch of the NBLOCKS disk blocks starting at BLOCK.
  */
 static
 int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_prefetch(struct sfs_fs *sfs, uint32_t block, unsigned nblocks)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
+	struct sfs_prefetch *pf;
 	int result;
 
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
+	pf = kmalloc(sizeof(*pf));
+	if (pf == NULL) {
+		return ENOMEM;
+	}
+	pf->pf_sfs = sfs;
+	pf->pf_block = block;
+	pf->pf_nblocks = nblocks;
 
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
+	lock_acquire(sfs->sfs_vnlock);
+	sfs->sfs_prefetches++;
+	lock_release(sfs->sfs_vnlock);
 
-	/* do it */
-	result = sfs_io(sv, &ku);
+	result = workqueue_submit(sfs_prefetch_work, pf);
 	if (result) {
+		kfree(pf);
+		lock_acquire(sfs->sfs_vnlock);
+		sfs->sfs_prefetches--;
+		if (sfs->sfs_prefetches == 0) {
+			cv_broadcast(sfs->sfs_prefetchcv, sfs->sfs_vnlock);
+		}
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	return 0;
+}
 
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+/*
+ * Prefetch file blocks FIRST through LAST-1, one request per run of
+ * blocks that are consecutive on disk. Holes are skipped. Returns
+ * the first block not queued, which is LAST unless something failed.
+ */
+static
+uint32_t
+sfs_prefetch_range(struct sfs_vnode *sv, uint32_t first, uint32_t last)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblock, diskblock, runstart, runfile;
+	unsigned runlen;
+
+	runstart = 0;
+	runfile = first;
+	runlen = 0;
+	for (fileblock = first; fileblock <= last; fileblock++) {
+		diskblock = 0;
+		if (fileblock < last &&
+		    sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			/* Give up; queue what we have so far. */
+			last = fileblock;
+			diskblock = 0;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen &&
+		    runlen < BUF_MAXRUN) {
+			runlen++;
+			continue;
+		}
+		if (runlen > 0) {
+			if (sfs_prefetch(sfs, runstart, runlen)) {
+				return runfile;
+			}
+		}
+		runstart = diskblock;
+		runfile = fileblock;
+		runlen = (diskblock != 0) ? 1 : 0;
 	}
+	return last;
+}
 
-	/* Done */
-	return 0;
+/*
+ * Called after a successful read from POS to ENDPOS: update the
+ * access pattern and start read-ahead if it looks sequential.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t pos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t bs = sfs->sfs_blocksize;
+	uint32_t curblock, eofblock, window, maxwindow;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (pos != sv->sv_ranext) {
+		/* Random access; stop reading ahead. */
+		sv->sv_ranext = endpos;
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		return;
+	}
+	sv->sv_ranext = endpos;
+
+	if (endpos >= (off_t)sv->sv_i.sfi_size) {
+		/* Nothing left to read ahead. */
+		return;
+	}
+	curblock = endpos / bs;
+	eofblock = SFS_ROUNDUP(sv->sv_i.sfi_size, bs) / bs;
+	if (sv->sv_raend < curblock) {
+		sv->sv_raend = curblock;
+	}
+
+	/* If we're still comfortably ahead of the reader, wait. */
+	if (sv->sv_rawindow > 0 &&
+	    sv->sv_raend - curblock >= sv->sv_rawindow / 2) {
+		return;
+	}
+
+	/* Open or widen the window. */
+	maxwindow = SFS_RA_MAXBYTES / bs;
+	if (maxwindow > SFS_RA_MAXWINDOW) {
+		maxwindow = SFS_RA_MAXWINDOW;
+	}
+	window = sv->sv_rawindow * 2;
+	if (window < SFS_RA_MINWINDOW) {
+		window = SFS_RA_MINWINDOW;
+	}
+	if (window > maxwindow) {
+		window = maxwindow;
+	}
+	sv->sv_rawindow = window;
+
+	if (curblock + window > eofblock) {
+		window = eofblock - curblock;
+	}
+	if (sv->sv_raend < curblock + window) {
+		sv->sv_raend = sfs_prefetch_range(sv, sv->sv_raend,
+						  curblock + window);
+	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// Directory I/O
+
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
  * vnode.
@@ -636,56 +1106,266 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Directory name index
+//
+// Rather than reading a directory one entry at a time on every
+// lookup, each directory vnode gets an in-memory index the first
+// time it's searched. Every slot has a struct sfs_dirent: slots in
+// use are on a hash chain keyed on the name, and empty slots are on
+// a free list. The index is updated by sfs_dir_link and
+// sfs_dir_unlink after the on-disk entry has been written, and it is
+// protected by the directory's sv_lock like the entries themselves.
+//
+// If memory runs out while updating the index, it's thrown away and
+// rebuilt from disk the next time it's needed.
+
+/* Number of hash chains per directory. */
+#define SFS_DIRHASH_SIZE 32
+
+struct sfs_dirent {
+	struct sfs_dirent *de_next;	/* hash chain or free list */
+	uint32_t de_ino;		/* inode number, or SFS_NOINO */
+	int de_slot;			/* slot in the directory */
+	char de_name[SFS_NAMELEN];	/* name, if in use */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirent *di_hash[SFS_DIRHASH_SIZE];
+	struct sfs_dirent *di_free;	/* empty slots */
+};
+
+static
+unsigned
+sfs_dirhashfn(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % SFS_DIRHASH_SIZE;
+}
+
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Throw away a directory's index.
+ */
+static
+void
+sfs_dirindex_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirent *de;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+
+	for (i=0; i<SFS_DIRHASH_SIZE; i++) {
+		while ((de = di->di_hash[i]) != NULL) {
+			di->di_hash[i] = de->de_next;
+			kfree(de);
+		}
+	}
+	while ((de = di->di_free) != NULL) {
+		di->di_free = de->de_next;
+		kfree(de);
+	}
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Put a slot into the index, either on a hash chain or, if it is
+ * empty, on the free list.
  */
+static
+void
+sfs_dirindex_insert(struct sfs_dirindex *di, struct sfs_dirent *de)
+{
+	unsigned h;
+
+	if (de->de_ino == SFS_NOINO) {
+		de->de_next = di->di_free;
+		di->di_free = de;
+	}
+	else {
+		h = sfs_dirhashfn(de->de_name);
+		de->de_next = di->di_hash[h];
+		di->di_hash[h] = de;
+	}
+}
 
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dirindex_add(struct sfs_dirindex *di, uint32_t ino, const char *name,
+		 int slot)
 {
-	struct sfs_dir tsd;
-	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	struct sfs_dirent *de;
 
-	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_ino = ino;
+	de->de_slot = slot;
+	if (ino == SFS_NOINO) {
+		de->de_name[0] = 0;
+	}
+	else {
+		strcpy(de->de_name, name);
+	}
+	sfs_dirindex_insert(di, de);
+	return 0;
+}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, &tsd, i);
-		if (result) {
-			return result;
+/*
+ * Build the index for a directory, if it doesn't already have one.
+ * Reads the directory a block at a time.
+ */
+static
+int
+sfs_dirindex_load(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirindex *di;
+	struct sfs_dir *sds;
+	struct iovec iov;
+	struct uio ku;
+	const int perblock = sfs->sfs_blocksize / sizeof(struct sfs_dir);
+	int nentries, base, i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirindex != NULL) {
+		return 0;
+	}
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_DIRHASH_SIZE; i++) {
+		di->di_hash[i] = NULL;
+	}
+	di->di_free = NULL;
+	sv->sv_dirindex = di;
+
+	sds = kmalloc(sfs->sfs_blocksize);
+	if (sds == NULL) {
+		sfs_dirindex_destroy(sv);
+		return ENOMEM;
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	for (base=0; base<nentries; base += perblock) {
+		n = nentries - base;
+		if (n > perblock) {
+			n = perblock;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
-			}
+
+		uio_kinit(&iov, &ku, sds, n * sizeof(struct sfs_dir),
+			  (off_t)base * sizeof(struct sfs_dir), UIO_READ);
+		result = sfs_io(sv, &ku);
+		if (result == 0 && ku.uio_resid > 0) {
+			panic("sfs: dirindex: Short read (inode %u)\n",
+			      sv->sv_ino);
 		}
-		else {
+
+		for (i=0; result == 0 && i<n; i++) {
 			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
+			sds[i].sfd_name[sizeof(sds[i].sfd_name)-1] = 0;
+			result = sfs_dirindex_add(di, sds[i].sfd_ino,
+						  sds[i].sfd_name, base+i);
+		}
 
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
+		if (result) {
+			kfree(sds);
+			sfs_dirindex_destroy(sv);
+			return result;
+		}
+	}
 
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
-			}
+	kfree(sds);
+	return 0;
+}
+
+/*
+ * Find the index entry for NAME, or NULL.
+ */
+static
+struct sfs_dirent *
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirent *de;
+
+	for (de = di->di_hash[sfs_dirhashfn(name)]; de != NULL;
+	     de = de->de_next) {
+		if (!strcmp(de->de_name, name)) {
+			return de;
 		}
 	}
+	return NULL;
+}
+
+/*
+ * Unhook DE from the hash chain it's on.
+ */
+static
+void
+sfs_dirindex_unhash(struct sfs_dirindex *di, struct sfs_dirent *de)
+{
+	struct sfs_dirent **pde;
 
-	return found ? 0 : ENOENT;
+	for (pde = &di->di_hash[sfs_dirhashfn(de->de_name)]; *pde != de;
+	     pde = &(*pde)->de_next) {
+		KASSERT(*pde != NULL);
+	}
+	*pde = de->de_next;
+	de->de_next = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirent *de;
+	int result;
+
+	result = sfs_dirindex_load(sv);
+	if (result) {
+		return result;
+	}
+
+	if (emptyslot != NULL && sv->sv_dirindex->di_free != NULL) {
+		*emptyslot = sv->sv_dirindex->di_free->de_slot;
+	}
+
+	de = sfs_dirindex_find(sv->sv_dirindex, name);
+	if (de == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = de->de_slot;
+	}
+	if (ino != NULL) {
+		*ino = de->de_ino;
+	}
+	return 0;
 }
 
 /*
@@ -696,6 +1376,8 @@ static
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_dirindex *di;
+	struct sfs_dirent *de;
 	int emptyslot = -1;
 	int result;
 	struct sfs_dir sd;
@@ -723,31 +1405,72 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/* Write the entry. */
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	/*
+	 * Update the index: reuse the free slot's entry if we took
+	 * one, or add a new one for a slot at the end.
+	 */
+	di = sv->sv_dirindex;
+	KASSERT(di != NULL);
+	de = di->di_free;
+	if (de != NULL && de->de_slot == emptyslot) {
+		di->di_free = de->de_next;
+		de->de_ino = ino;
+		strcpy(de->de_name, name);
+		sfs_dirindex_insert(di, de);
+	}
+	else if (sfs_dirindex_add(di, ino, name, emptyslot)) {
+		sfs_dirindex_destroy(sv);
+	}
+
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME must be the name
+ * in that slot.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
+	struct sfs_dirindex *di;
+	struct sfs_dirent *de;
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	/* Move the slot to the free list. */
+	di = sv->sv_dirindex;
+	if (di != NULL) {
+		de = sfs_dirindex_find(di, name);
+		KASSERT(de != NULL && de->de_slot == slot);
+		sfs_dirindex_unhash(di, de);
+		de->de_ino = SFS_NOINO;
+		de->de_name[0] = 0;
+		sfs_dirindex_insert(di, de);
+	}
+
+	return 0;
 }
 
 /*
@@ -782,35 +1505,227 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 	return 0;
 }
 
-////////////////////////////////////////////////////////////
-//
-// Object creation
-
+////////////////////////////////////////////////////////////
+//
+// Object creation
+
+/*
+ * Create a new filesystem object and hand back its vnode.
+ */
+static
+int
+sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+{
+	uint32_t ino;
+	int result;
+
+	/*
+	 * First, get an inode. (Each inode is a block, and the inode 
+	 * number is the block number, so just get a block.)
+	 */
+
+	result = sfs_balloc(sfs, 0, &ino);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Now load a vnode for it.
+	 */
+
+	return sfs_loadvnode(sfs, ino, type, ret);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+//
+// Loaded vnodes are kept in a hash table keyed on inode number. The
+// chains are doubly linked through sv_hashprev so a vnode can be
+// unhooked without searching. All of this requires sfs_vnlock.
+
+static
+unsigned
+sfs_vnhashfn(uint32_t ino)
+{
+	return ino % SFS_VNHASH_SIZE;
+}
+
+/*
+ * Find a loaded vnode by inode number.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhashfn(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **head;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	head = &sfs->sfs_vnhash[sfs_vnhashfn(sv->sv_ino)];
+	sv->sv_hashnext = *head;
+	sv->sv_hashprev = head;
+	if (*head != NULL) {
+		(*head)->sv_hashprev = &sv->sv_hashnext;
+	}
+	*head = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_hashprev != NULL);
+	KASSERT(*sv->sv_hashprev == sv);
+	KASSERT(sfs->sfs_nvnodes > 0);
+
+	*sv->sv_hashprev = sv->sv_hashnext;
+	if (sv->sv_hashnext != NULL) {
+		sv->sv_hashnext->sv_hashprev = sv->sv_hashprev;
+	}
+	sv->sv_hashnext = NULL;
+	sv->sv_hashprev = NULL;
+	sfs->sfs_nvnodes--;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Inactive list
+//
+// When the last reference to a vnode goes away, sfs_reclaim syncs it
+// but doesn't free it: it stays in the table, and goes on the tail
+// of the inactive list, which keeps the reference VOP_DECREF handed
+// to sfs_reclaim. If the file is opened again soon sfs_loadvnode
+// finds it and takes that reference over, and there's no inode to
+// read back in. The least recently used vnodes are freed when the
+// list grows past SFS_INACTIVEMAX, when memory runs short, and at
+// unmount. Files with no links left aren't kept. All of this
+// requires sfs_vnlock.
+
+static
+void
+sfs_inactive_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_inactive);
+
+	sv->sv_inactnext = NULL;
+	sv->sv_inactprev = sfs->sfs_inacttail;
+	if (sfs->sfs_inacttail != NULL) {
+		sfs->sfs_inacttail->sv_inactnext = sv;
+	}
+	else {
+		sfs->sfs_inacthead = sv;
+	}
+	sfs->sfs_inacttail = sv;
+	sv->sv_inactive = true;
+	sfs->sfs_ninactive++;
+}
+
+static
+void
+sfs_inactive_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_inactive);
+	KASSERT(sfs->sfs_ninactive > 0);
+
+	if (sv->sv_inactprev != NULL) {
+		sv->sv_inactprev->sv_inactnext = sv->sv_inactnext;
+	}
+	else {
+		KASSERT(sfs->sfs_inacthead == sv);
+		sfs->sfs_inacthead = sv->sv_inactnext;
+	}
+	if (sv->sv_inactnext != NULL) {
+		sv->sv_inactnext->sv_inactprev = sv->sv_inactprev;
+	}
+	else {
+		KASSERT(sfs->sfs_inacttail == sv);
+		sfs->sfs_inacttail = sv->sv_inactprev;
+	}
+	sv->sv_inactprev = sv->sv_inactnext = NULL;
+	sv->sv_inactive = false;
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Release the memory for a vnode that is no longer in the table.
+ */
+static
+void
+sfs_vnode_free(struct sfs_vnode *sv)
+{
+	VOP_CLEANUP(&sv->sv_v);
+	sfs_dirindex_destroy(sv);
+	lock_destroy(sv->sv_iolock);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Free the least recently used inactive vnode. Skips any that
+ * sfs_sync has a reference to at the moment; nothing else can get
+ * one while we hold sfs_vnlock. Returns false if there's nothing
+ * that can be freed.
  */
 static
-int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+bool
+sfs_inactive_evict(struct sfs_fs *sfs)
 {
-	uint32_t ino;
-	int result;
+	struct sfs_vnode *sv;
+	bool busy;
 
-	/*
-	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
-	 */
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
 
-	result = sfs_balloc(sfs, &ino);
-	if (result) {
-		return result;
+	for (sv = sfs->sfs_inacthead; sv != NULL; sv = sv->sv_inactnext) {
+		spinlock_acquire(&sv->sv_v.vn_countlock);
+		busy = sv->sv_v.vn_refcount > 1;
+		spinlock_release(&sv->sv_v.vn_countlock);
+		if (!busy) {
+			break;
+		}
+	}
+	if (sv == NULL) {
+		return false;
 	}
 
-	/*
-	 * Now load a vnode for it.
-	 */
+	/* It was synced when it went inactive and hasn't changed. */
+	KASSERT(!sv->sv_dirty);
 
-	return sfs_loadvnode(sfs, ino, type, ret);
+	sfs_inactive_remove(sfs, sv);
+	sfs_vnhash_remove(sfs, sv);
+	sfs_vnode_free(sv);
+	return true;
+}
+
+void
+sfs_inactive_purge(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_vnlock);
+	while (sfs_inactive_evict(sfs)) {
+		/* nothing */
+	}
+	lock_release(sfs->sfs_vnlock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -881,6 +1796,8 @@ sfs_close(struct vnode *v)
 
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
+ * Unless the file has been removed, the vnode isn't actually freed
+ * yet; it goes on the inactive list, which keeps our reference.
  *
  * This function should try to avoid returning errors other than EBUSY.
  */
@@ -890,31 +1807,47 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/* Erasing the file changes metadata; see sfs_journal.c. */
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from doing so while we work.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Give back any blocks set aside for appending. */
+	sfs_prealloc_release(sv);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 	}
@@ -922,38 +1855,36 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
-
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	/* If it's still linked, keep it in case it's wanted again. */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		sfs_inactive_add(sfs, sv);
+		if (sfs->sfs_ninactive > SFS_INACTIVEMAX) {
+			sfs_inactive_evict(sfs);
 		}
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		return 0;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	VOP_CLEANUP(&sv->sv_v);
+	/* There are no on-disk references, so discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
+
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_free(sv);
 
 	/* Done */
 	return 0;
@@ -967,32 +1898,76 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t pos;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_iolock);
+	lock_acquire(sv->sv_lock);
+	pos = uio->uio_offset;
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0) {
+		sfs_readahead(sv, pos, uio->uio_offset);
+	}
+	lock_release(sv->sv_lock);
+	lock_release(sv->sv_iolock);
 
 	return result;
 }
 
 /*
  * Called for write(). sfs_io() does the work.
+ *
+ * Each journal transaction only has room for so many new blocks, so
+ * with a journal the write is done SFS_JWRITEBLOCKS blocks at a time,
+ * each in its own transaction, and the inode is logged along with
+ * each piece. sv_lock has to be let go between pieces, since
+ * sfs_jbegin may wait for a commit; sv_iolock, held throughout, keeps
+ * other reads, writes, and truncates from getting in between. (A
+ * crash can still leave only the first pieces on disk.) Either way
+ * the inode goes into the buffer cache right away, so background
+ * writeback covers it too. As in sfs_io, the part of uio_resid not
+ * being done yet is kept in EXTRARESID meanwhile.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t chunk, extraresid;
+	int result, result2;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_acquire(sv->sv_iolock);
+	do {
+		extraresid = 0;
+		if (sfs->sfs_journal != NULL) {
+			chunk = SFS_JWRITEBLOCKS * sfs->sfs_blocksize
+				- uio->uio_offset % sfs->sfs_blocksize;
+			if (uio->uio_resid > chunk) {
+				extraresid = uio->uio_resid - chunk;
+				uio->uio_resid = chunk;
+			}
+		}
+
+		result = sfs_jbegin(sfs);
+		if (result == 0) {
+			lock_acquire(sv->sv_lock);
+			result = sfs_io(sv, uio);
+			result2 = sfs_sync_inode(sv);
+			if (result == 0) {
+				result = result2;
+			}
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
+		}
+
+		uio->uio_resid += extraresid;
+	} while (result == 0 && extraresid > 0);
+	lock_release(sv->sv_iolock);
 
 	return result;
 }
@@ -1033,7 +2008,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +2030,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1091,6 +2065,87 @@ sfs_tryseek(struct vnode *v, off_t pos)
 	return 0;
 }
 
+/*
+ * Write back everything under indirect block IDBLOCK (at indirection
+ * LEVEL), and then the indirect block itself.
+ */
+static
+int
+sfs_writeback_indirect(struct sfs_fs *sfs, uint32_t idblock, unsigned level)
+{
+	struct device *dev = sfs->sfs_device;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j;
+	int result = 0;
+
+	if (idblock == 0) {
+		return 0;
+	}
+
+	result = sfs_bread(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+	for (j=0; j<sfs->sfs_dbperidb && result==0; j++) {
+		if (iddata[j] == 0) {
+			continue;
+		}
+		if (level == 1) {
+			result = buffer_writeback(dev, iddata[j],
+						  sfs->sfs_blocksize);
+		}
+		else {
+			result = sfs_writeback_indirect(sfs, iddata[j],
+							level-1);
+		}
+	}
+	buffer_release(idbuf);
+	if (result) {
+		return result;
+	}
+
+	return buffer_writeback(dev, idblock, sfs->sfs_blocksize);
+}
+
+/*
+ * Write back any dirty buffers belonging to a file: its data blocks,
+ * its indirect blocks, and its inode.
+ */
+static
+int
+sfs_writeback_file(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct device *dev = sfs->sfs_device;
+	uint32_t i, block;
+	unsigned level;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (block != 0) {
+			result = buffer_writeback(dev, block,
+						  sfs->sfs_blocksize);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	for (level=1; level<=SFS_NINDIRECT_LEVELS; level++) {
+		result = sfs_writeback_indirect(sfs,
+						*sfs_indirect_ptr(sv, level),
+						level);
+		if (result) {
+			return result;
+		}
+	}
+	return buffer_writeback(dev, sv->sv_ino, sfs->sfs_blocksize);
+}
+
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
@@ -1100,11 +2155,34 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * With a journal, log the inode and commit; commit writes out
+	 * the file's data first.
+	 */
+	if (sfs->sfs_journal != NULL) {
+		result = sfs_jbegin(sfs);
+		if (result) {
+			return result;
+		}
+		lock_acquire(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		if (result) {
+			return result;
+		}
+		return sfs_jcommit(sfs);
+	}
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result == 0) {
+		result = sfs_writeback_file(sv);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1121,35 +2199,122 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncation helper for indirect blocks. *IDPTR is an indirect block
+ * at indirection LEVEL whose first entry maps file block BASE; free
+ * every block under it that maps file blocks at or past BLOCKLEN. If
+ * that leaves it empty, free it too and clear *IDPTR. Sets *CHANGED
+ * if *IDPTR was changed, so the caller knows to mark whatever holds
+ * it dirty.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *idptr, unsigned level,
+		    uint32_t base, uint32_t blocklen, bool *changed)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span, j, entrybase;
+	bool hasnonzero, iddirty, sub;
+	unsigned k;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	*changed = false;
+	if (*idptr == 0) {
+		return 0;
+	}
+
+	/* File blocks mapped by each entry */
+	span = 1;
+	for (k=1; k<level; k++) {
+		span *= sfs->sfs_dbperidb;
+	}
+
+	if (blocklen >= base + span * sfs->sfs_dbperidb) {
+		/* Entirely before the new EOF; nothing to do. */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = sfs_bread(sfs, *idptr, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<sfs->sfs_dbperidb; j++) {
+		entrybase = base + j*span;
+		if (iddata[j] == 0) {
+			continue;
+		}
+		if (level == 1) {
+			/* Discard any blocks that are past the new EOF */
+			if (entrybase >= blocklen) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
+				iddirty = true;
+			}
+		}
+		else if (entrybase + span > blocklen) {
+			/* Some of what's under this entry must go */
+			result = sfs_itrunc_indirect(sfs, &iddata[j],
+						     level-1, entrybase,
+						     blocklen, &sub);
+			if (sub) {
+				iddirty = true;
+			}
+			if (result) {
+				if (iddirty) {
+					sfs_jdirty(sfs, idbuf, *idptr);
+				}
+				buffer_release(idbuf);
+				return result;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	/* (No point logging it if it's about to be freed.) */
+	if (iddirty && hasnonzero) {
+		sfs_jdirty(sfs, idbuf, *idptr);
+	}
+	buffer_release(idbuf);
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idptr);
+		*idptr = 0;
+		*changed = true;
+	}
+	return 0;
+}
+
+/*
+ * Truncate the file to LEN. Called from sfs_truncate and sfs_reclaim,
+ * with sv_lock held.
+ */
+static
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block, base, span;
+	unsigned level;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/* Blocks set aside for appending are past the end by definition. */
+	sfs_prealloc_release(sv);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +2329,20 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
+	/* Then each of the indirect blocks, in file order. */
+	base = SFS_NDIRECT;
+	span = sfs->sfs_dbperidb;
+	for (level=1; level<=SFS_NINDIRECT_LEVELS; level++) {
+		result = sfs_itrunc_indirect(sfs, sfs_indirect_ptr(sv, level),
+					     level, base, blocklen, &changed);
+		if (changed) {
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+		if (result) {
+			return result;
 		}
+		base += span;
+		span *= sfs->sfs_dbperidb;
 	}
 
 	/* Set the file size */
@@ -1220,10 +2351,41 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result, result2;
+
+	lock_acquire(sv->sv_iolock);
+	result = sfs_jbegin(sfs);
+	if (result) {
+		lock_release(sv->sv_iolock);
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	/* Log the inode with the blocks it gave up, even on failure. */
+	result2 = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = result2;
+	}
+	lock_release(sv->sv_lock);
+
+	sfs_jend(sfs);
+	lock_release(sv->sv_iolock);
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +2421,25 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
@@ -1278,18 +2447,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1298,21 +2470,34 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
+	if (result == 0) {
+		/* The directory may have grown. */
+		result = sfs_sync_inode(sv);
+	}
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		/* Reclaiming it starts a transaction of its own. */
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
-	/* and consequently mark it dirty. */
+	/*
+	 * and consequently mark it dirty. Log it with the directory
+	 * entry if we can; if not, it stays dirty and goes out later.
+	 */
 	newguy->sv_dirty = true;
+	(void)sfs_sync_inode(newguy);
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -1325,26 +2510,42 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Directory first, then file; see sfs.h. */
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
+	if (result == 0) {
+		/* The directory may have grown. */
+		result = sfs_sync_inode(sv);
+	}
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	(void)sfs_sync_inode(f);
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -1355,33 +2556,50 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
+	KASSERT(victim != sv);
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		(void)sfs_sync_inode(victim);
+		lock_release(victim->sv_lock);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. This may
+	 * reclaim the file, so do it without the directory locked,
+	 * and outside the transaction (reclaiming starts its own).
+	 */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1396,20 +2614,33 @@ int
 sfs_rename(struct vnode *d1, const char *n1, 
 	   struct vnode *d2, const char *n2)
 {
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Lock ordering: the directory, then the file being renamed.
+	 * The file's lock is only taken briefly to update its link
+	 * count. With only one directory there is never a second
+	 * directory lock to order against.
+	 */
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1430,11 +2661,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1443,32 +2676,43 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	(void)sfs_sync_inode(g1);
+	lock_release(g1->sv_lock);
+
+	/* The directory may have grown. */
+	(void)sfs_sync_inode(sv);
+
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2730,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* Nothing here touches mutable inode state; no lock needed. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2743,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2760,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1645,48 +2882,62 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * The inode is read in without sfs_vnlock held, so one slow disk read
+ * doesn't hold up every other lookup on the volume. While that's
+ * going on the new vnode is in the table marked sv_loading; anyone
+ * else who wants the same inode waits for it on sfs_loadcv and then
+ * looks again.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	while ((sv = sfs_vnhash_find(sfs, ino)) != NULL && sv->sv_loading) {
+		cv_wait(sfs->sfs_loadcv, sfs->sfs_vnlock);
+	}
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
+		if (sv->sv_inactive) {
+			/* Take over the inactive list's reference */
+			sfs_inactive_remove(sfs, sv);
+		}
+		else {
 			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		/* Short of memory; free the inactive vnodes and retry */
+		while (sfs_inactive_evict(sfs)) {
+			/* nothing */
+		}
+		sv = kmalloc(sizeof(struct sfs_vnode));
+	}
+	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1696,11 +2947,18 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino);
 	}
 
+	/* Hold its place in the table while we read it */
+	sv->sv_ino = ino;
+	sv->sv_loading = true;
+	sv->sv_inactive = false;
+	sv->sv_inactprev = sv->sv_inactnext = NULL;
+	sfs_vnhash_add(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_rblock(sfs, &sv->sv_i, sizeof(sv->sv_i), ino);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
 	/* Not dirty yet */
@@ -1733,27 +2991,54 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	sv->sv_iolock = lock_create("sfs_vnode_io");
+	if (sv->sv_iolock == NULL) {
+		lock_destroy(sv->sv_lock);
+		result = ENOMEM;
+		goto fail;
+	}
+
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		lock_destroy(sv->sv_iolock);
+		lock_destroy(sv->sv_lock);
+		goto fail;
 	}
 
 	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sv->sv_dirindex = NULL;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_nextalloc = 0;
+	sv->sv_prealloc = 0;
+	sv->sv_npreallocs = 0;
+
+	/* Nobody else can have loaded it meanwhile; let them have it. */
+	lock_acquire(sfs->sfs_vnlock);
+	KASSERT(sfs_vnhash_find(sfs, ino) == sv);
+	sv->sv_loading = false;
+	cv_broadcast(sfs->sfs_loadcv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	/* Take out the placeholder; anyone waiting will try for themselves */
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnhash_remove(sfs, sv);
+	cv_broadcast(sfs->sfs_loadcv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	kfree(sv);
+	return result;
 }
 
 /*
@@ -1767,14 +3052,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -0,0 +1,115 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * A cache of disk blocks, keyed by (device, block number), shared by
+ * all mounted filesystems. A buffer is obtained with buffer_read
+ * (contents loaded from disk if not already cached) or buffer_get
+ * (contents not loaded, for when the caller is about to overwrite the
+ * whole block). Either way the buffer comes back pinned: it cannot be
+ * evicted until it is handed back with buffer_release. Nothing stops
+ * two threads from pinning the same buffer at once; serializing
+ * access to the contents is up to the filesystem.
+ *
+ * Writes are delayed. Modifying a buffer and calling buffer_mark_dirty
+ * only marks it; it goes to disk when it is evicted to make room, when
+ * someone calls buffer_writeback or buffer_sync, or when a background
+ * flusher thread gets to it: after BUF_DIRTYAGE seconds, or sooner if
+ * more than BUF_DIRTYMAX bytes are dirty. Dirty buffers for adjacent
+ * blocks are written back together.
+ *
+ * Unpinned buffers are kept on an LRU list and the least recently
+ * released one is reused first. The total size of the cache is fixed
+ * (BUF_MAXBYTES); if every buffer is pinned, buffer_get waits.
+ *
+ * Buffers may be of any size, but all users of a given block must
+ * agree on it.
+ */
+
+struct device;
+struct buf;	/* private to buf.c */
+
+/* Total space for cached data, in bytes. */
+#define BUF_MAXBYTES	(128*1024)
+
+/* Most blocks moved to or from the device in one transfer. */
+#define BUF_MAXRUN	16
+
+/* Background writeback: oldest dirty data, in seconds, and most bytes. */
+#define BUF_DIRTYAGE	5
+#define BUF_DIRTYMAX	(BUF_MAXBYTES / 2)
+
+/* Get a pinned buffer, reading its contents from disk if needed. */
+int buffer_read(struct device *dev, uint32_t block, size_t size,
+		struct buf **ret);
+
+/*
+ * Get a pinned buffer without reading it. If it wasn't already valid,
+ * buffer_readrun leaves it alone until the caller has filled it in
+ * and called buffer_mark_valid (or given up and released it).
+ */
+int buffer_get(struct device *dev, uint32_t block, size_t size,
+	       struct buf **ret);
+
+/*
+ * Get pinned buffers for the *NBLOCKS blocks starting at BLOCK, with
+ * the ones not already cached read in a single transfer. May return
+ * fewer than asked for (but at least one); *NBLOCKS is updated. At
+ * most BUF_MAXRUN.
+ */
+int buffer_readrun(struct device *dev, uint32_t block, size_t size,
+		   unsigned *nblocks, struct buf **bufs);
+
+/* Unpin a buffer. */
+void buffer_release(struct buf *b);
+
+/* Access to a pinned buffer. */
+void *buffer_map(struct buf *b);
+bool buffer_is_valid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+
+/*
+ * Keep a pinned buffer from being written back until it is released
+ * with buffer_unhold, e.g. because a journal hasn't committed its new
+ * contents yet. Holding takes a pin of its own, which buffer_unhold
+ * gives back. Writeback and sync skip held buffers.
+ */
+void buffer_hold(struct buf *b);
+void buffer_unhold(struct buf *b);
+
+/*
+ * Throw away any cached copy of a block without writing it, e.g.
+ * because the filesystem just freed it.
+ */
+void buffer_drop(struct device *dev, uint32_t block, size_t size);
+
+/* Write one block back if it is cached and dirty. */
+int buffer_writeback(struct device *dev, uint32_t block, size_t size);
+
+/*
+ * Write back every dirty buffer belonging to DEV that isn't held.
+ * That includes buffers other threads have pinned and may be in the
+ * middle of changing; a filesystem that logs its metadata must only
+ * call this when nobody can be.
+ */
+int buffer_sync(struct device *dev);
+
+/*
+ * Discard every buffer belonging to DEV, which must all be clean and
+ * unpinned. Used at unmount.
+ */
+void buffer_drop_device(struct device *dev);
+
+/* Print hit/miss statistics. */
+void buffer_printstats(void);
+
+/* Set up the cache. */
+void buffer_bootstrap(void);
+
+/* Start background writeback. Call after workqueue_bootstrap. */
+void buffer_flusher_start(void);
+
+#endif /* _BUF_H_ */
@@ -33,9 +33,17 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <cpustat.h>
+#include <workqueue.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of free kernel stacks each cpu keeps for reuse by
+ * thread_fork. See thread_stack_get in thread.c.
+ */
+#define CPU_STACKCACHE 8
+
 /*
  * Per-cpu structure
  *
@@ -60,6 +68,15 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_stats[CPUSTAT_COUNT]; /* Statistics; see <cpustat.h> */
+	struct work c_reapwork;		/* Deferred zombie cleanup */
+	void *c_stacks[CPU_STACKCACHE];	/* Cache of free thread stacks */
+	unsigned c_nstacks;		/* Number of entries in c_stacks */
+
+	/*
+	 * Set once by workqueue_bootstrap; then fixed.
+	 */
+	struct workqueue *c_workqueue;	/* Deferred work for this cpu */
 
 	/*
 	 * Accessed by other cpus.
@@ -109,6 +126,15 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the set of cpus.
+ *
+ * cpu_count returns the number of cpus created so far; cpu_get
+ * returns the cpu with the given software number (c_number).
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned software_number);
+
 /*
  * Return a string describing the CPU type.
  */
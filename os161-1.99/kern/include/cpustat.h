@@ -0,0 +1,64 @@
+#ifndef _CPUSTAT_H_
+#define _CPUSTAT_H_
+
+/*
+ * Per-cpu statistics counters.
+ *
+ * Every cpu carries its own array of counters (c_stats in struct
+ * cpu). Incrementing a counter only ever touches the current cpu's
+ * copy, so it needs neither a lock nor an atomic operation; all that
+ * is required is that the read-modify-write not be interrupted (and
+ * the thread possibly moved to another cpu) halfway through. The
+ * per-cpu copies are summed only when somebody asks for the value,
+ * which is rare compared to the increments.
+ *
+ * Totals read while other cpus are still counting are of course only
+ * a snapshot.
+ */
+
+#include <uw-vmstats.h>
+
+/* Sizes of the counter groups. */
+#define CPUSTAT_NTRAPS      16	/* MIPS exception codes (EX_* ) */
+#define CPUSTAT_NIRQS       32	/* one per LAMEbus slot (LB_NSLOTS) */
+#define CPUSTAT_NSYSCALLS   128	/* covers all of <kern/syscall.h> */
+
+/* Single counters. */
+#define CPUSTAT_CTXSWITCH   0	/* context switches */
+#define CPUSTAT_IPI         1	/* interprocessor interrupts taken */
+#define CPUSTAT_TIMER       2	/* on-chip timer interrupts */
+
+/* Counter groups; use the macros below to index them. */
+#define CPUSTAT_VM_BASE      3
+#define CPUSTAT_TRAP_BASE    (CPUSTAT_VM_BASE + VMSTAT_COUNT)
+#define CPUSTAT_IRQ_BASE     (CPUSTAT_TRAP_BASE + CPUSTAT_NTRAPS)
+#define CPUSTAT_SYSCALL_BASE (CPUSTAT_IRQ_BASE + CPUSTAT_NIRQS)
+#define CPUSTAT_COUNT        (CPUSTAT_SYSCALL_BASE + CPUSTAT_NSYSCALLS)
+
+#define CPUSTAT_VM(n)        (CPUSTAT_VM_BASE + (n))	/* VMSTAT_* */
+#define CPUSTAT_TRAP(n)      (CPUSTAT_TRAP_BASE + (n))	/* exception code */
+#define CPUSTAT_IRQ(n)       (CPUSTAT_IRQ_BASE + (n))	/* bus slot */
+#define CPUSTAT_SYSCALL(n)   (CPUSTAT_SYSCALL_BASE + (n)) /* SYS_* */
+
+/*
+ * Increment a counter on the current cpu.
+ *
+ * cpustat_inc raises the spl itself for the duration of the increment.
+ * _cpustat_inc assumes interrupts are already off on this cpu (as
+ * they are in interrupt handlers and with a spinlock held) and is
+ * correspondingly cheaper.
+ */
+void cpustat_inc(unsigned index);
+void _cpustat_inc(unsigned index);
+
+/*
+ * Read counters. cpustat_get returns the sum over all cpus;
+ * cpustat_getcpu returns a single cpu's value.
+ */
+unsigned cpustat_get(unsigned index);
+unsigned cpustat_getcpu(unsigned cpunum, unsigned index);
+
+/* Print all nonzero counters, with a per-cpu breakdown. */
+void cpustat_print(void);
+
+#endif /* _CPUSTAT_H_ */
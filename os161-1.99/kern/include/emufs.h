@@ -45,6 +45,16 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+
+	/* Caches, protected by ev_lock; see emu.c */
+	struct lock *ev_lock;
+	char *ev_cache;			/* read cache, or NULL */
+	off_t ev_cacheoff;		/* file offset of ev_cache */
+	uint32_t ev_cachelen;		/* bytes valid in ev_cache */
+	uint32_t ev_cachegen;		/* e_wgen when it was filled */
+	off_t ev_size;			/* file size */
+	bool ev_sizevalid;		/* ev_size has been fetched */
+	uint32_t ev_sizegen;		/* e_wgen when it was fetched */
 };
 
 struct emufs_fs {
@@ -37,27 +37,81 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_VERSION       3             /* current on-disk format version */
+#define SFS_BLOCKSIZE     512           /* default (and minimum) block size */
+#define SFS_MAXBLOCKSIZE  4096          /* largest supported block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/*
+ * Format versions (sp_version):
+ *    0  original format; only direct blocks and one indirect block.
+ *    1  adds the doubly and triply indirect blocks.
+ *    2  adds sp_blocksize; older volumes always have 512-byte blocks.
+ *    3  adds the metadata journal (sp_journalstart, sp_journalblocks).
+ * Each version is a subset of the next (the new fields were unused
+ * space, which is always zero), so old volumes are upgraded in place
+ * when mounted.
+ *
+ * The block size is chosen by mksfs. It is a power of two, a multiple
+ * of the device sector size, and between SFS_BLOCKSIZE and
+ * SFS_MAXBLOCKSIZE. The superblock and inodes are always
+ * SFS_BLOCKSIZE bytes, at the start of their block; the rest of the
+ * block is zero. Indirect blocks, directory blocks, and the freemap
+ * are sized to the block.
+ */
+#define HAS_DIDIRECT                    /* inodes have sfi_dindirect */
+#define HAS_TIDIRECT                    /* inodes have sfi_tindirect */
+
+/* Number of direct blocks per indirect block, for block size BS */
+#define SFS_DBPERIDB(bs)  ((bs) / sizeof(uint32_t))
+
 /* Number of bits in a block */
-#define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BLOCKBITS(bs) ((bs) * CHAR_BIT)
 
 /* Utility macro */
-#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
+#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*(b))
 
 /* Size of bitmap (in bits) */
-#define SFS_BITMAPSIZE(nblocks) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS)
+#define SFS_BITMAPSIZE(nblocks, bs) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS(bs))
 
 /* Size of bitmap (in blocks) */
-#define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
+#define SFS_BITBLOCKS(nblocks, bs) \
+	(SFS_BITMAPSIZE(nblocks, bs)/SFS_BLOCKBITS(bs))
+
+/*
+ * Journal (version 3 and up).
+ *
+ * If sp_journalblocks is nonzero, that many blocks starting at
+ * sp_journalstart (right after the freemap, as laid out by mksfs)
+ * hold a write-ahead log of metadata updates: inodes, indirect
+ * blocks, directory blocks, and the freemap. The journal blocks are
+ * marked in use in the freemap.
+ *
+ * The first journal block is a header (SFS_JMAGIC) whose jb_seq is
+ * the sequence number of the first transaction to replay. The
+ * transactions follow, one after another, starting at the second
+ * journal block. Each is a descriptor block (SFS_JDESCMAGIC) listing
+ * in jb_blocks the home locations of the jb_count blocks that follow
+ * it, then a commit block (SFS_JCOMMITMAGIC). Both carry the
+ * transaction's sequence number, which goes up by one each time.
+ *
+ * Recovery replays transactions in order, copying each logged block
+ * to its home location, until it finds one that doesn't carry the
+ * expected sequence number or has no commit block, then writes a new
+ * header. All three kinds of journal block are SFS_BLOCKSIZE bytes
+ * of struct sfs_jblock at the start of their block.
+ */
+#define SFS_JMAGIC        0x4a524e4c    /* journal header */
+#define SFS_JDESCMAGIC    0x4a445343    /* transaction descriptor */
+#define SFS_JCOMMITMAGIC  0x4a434d54    /* transaction commit */
+#define SFS_JMAXBLOCKS    125           /* most blocks in a transaction */
+#define SFS_JMAXBYTES     65536         /* ...and most bytes */
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
@@ -71,7 +125,11 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_version;			/* On-disk format version */
+	uint32_t sp_blocksize;			/* Block size in bytes */
+	uint32_t sp_journalstart;		/* First journal block */
+	uint32_t sp_journalblocks;		/* Journal size (0 if none) */
+	uint32_t reserved[114];
 };
 
 /*
@@ -83,7 +141,19 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Doubly indirect block */
+	uint32_t sfi_tindirect;			/* Triply indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+};
+
+/*
+ * On-disk journal header, descriptor, or commit block
+ */
+struct sfs_jblock {
+	uint32_t jb_magic;			/* One of SFS_J*MAGIC above */
+	uint32_t jb_seq;			/* Transaction number */
+	uint32_t jb_count;			/* Blocks logged (descriptor) */
+	uint32_t jb_blocks[SFS_JMAXBLOCKS];	/* Their home locations */
 };
 
 /*
@@ -159,6 +159,7 @@ const char *strerror(int errcode);
  * kprintf does this.
  */
 void putch(int ch);
+void putchars(const char *buf, size_t len);
 void putch_prepare(void);
 void putch_complete(void);
 int getch(void);
@@ -41,6 +41,7 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <workqueue.h>
 
 /*
  * Get on-disk structures and constants that are made available to 
@@ -48,21 +49,111 @@
  */
 #include <kern/sfs.h>
 
+struct buf;	/* in <buf.h> */
+struct sfs_dirindex;	/* private to sfs_vnode.c */
+struct sfs_journal;	/* private to sfs_journal.c */
+
+/*
+ * Locking.
+ *
+ * Each vnode has a lock, sv_lock, covering the in-memory inode
+ * (sv_i, sv_dirty) and the contents of the file's blocks, including
+ * its indirect block and, for a directory, its entries and the name
+ * index built from them, and the allocation and read-ahead state
+ * that follows the file's blocks around. sv_ino and
+ * the inode type never change once the vnode is loaded.
+ *
+ * A second lock, sv_iolock, is held across a whole read, write, or
+ * truncate of a file. With a journal a large write is split into
+ * several transactions, and sv_lock can't be kept between them (see
+ * sfs_jbegin); sv_iolock keeps the write in one piece as far as other
+ * readers, writers, and truncate can tell.
+ *
+ * sfs_vnlock protects the table of loaded vnodes (sfs_vnhash and the
+ * sv_hash links) and the inactive list (sfs_inact*, sv_inact*), and
+ * is what sfs_loadvnode and sfs_reclaim synchronize on. It also
+ * covers the count of read-ahead requests in flight, sfs_prefetches.
+ * sfs_loadvnode doesn't hold it while reading an inode in; the vnode
+ * sits in the table marked sv_loading meanwhile, and anyone else
+ * looking for it waits on sfs_loadcv.
+ * sfs_freemaplock protects the free block bitmap, the allocation
+ * map (the free block bitmap plus blocks reserved for files that are
+ * growing, which only ever exists in memory), and the background
+ * sync state.
+ * The journal has its own lock, private to sfs_journal.c.
+ *
+ * Lock ordering:
+ *    1. sv_iolock of a file
+ *    2. sv_lock of a directory
+ *    3. sv_lock of a file in that directory
+ *    4. sfs_vnlock
+ *    5. the journal lock
+ *    6. sfs_freemaplock
+ *    7. buffer cache (see <buf.h>)
+ * An operation that changes metadata must also start its journal
+ * transaction (sfs_jbegin) after sv_iolock and before the rest.
+ * Nothing holds two vnode locks except in directory-then-file order.
+ * In particular rename (which, as there are no subdirectories, always
+ * has a single directory) locks the directory and then the file being
+ * renamed.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* see above */
+	struct lock *sv_iolock;         /* see above */
+	struct sfs_dirindex *sv_dirindex; /* directory name index, or NULL */
+	struct sfs_vnode *sv_hashnext;  /* next on hash chain */
+	struct sfs_vnode **sv_hashprev; /* pointer that points to us */
+	off_t sv_ranext;                /* where a sequential read goes next */
+	uint32_t sv_rawindow;           /* read-ahead window, in blocks */
+	uint32_t sv_raend;              /* first file block not prefetched */
+	uint32_t sv_nextalloc;          /* where to look for a new block */
+	uint32_t sv_prealloc;           /* first block reserved for appends */
+	uint32_t sv_npreallocs;         /* number of blocks reserved */
+	bool sv_loading;                /* inode still being read in */
+	bool sv_inactive;               /* on the inactive list */
+	struct sfs_vnode *sv_inactprev; /* inactive list links */
+	struct sfs_vnode *sv_inactnext;
 };
 
+/* Number of hash chains for loaded vnodes, hashed on inode number. */
+#define SFS_VNHASH_SIZE 64
+
+/* Most unused vnodes kept loaded on the inactive list. */
+#define SFS_INACTIVEMAX 32
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	uint32_t sfs_blocksize;         /* block size (from sfs_super) */
+	uint32_t sfs_dbperidb;          /* entries per indirect block */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* number of loaded vnodes */
+	struct sfs_vnode *sfs_inacthead; /* inactive list, LRU first */
+	struct sfs_vnode *sfs_inacttail;
+	unsigned sfs_ninactive;         /* number on inactive list */
+	struct lock *sfs_vnlock;        /* protects sfs_vnhash */
+	unsigned sfs_prefetches;        /* read-ahead requests in flight */
+	struct cv *sfs_prefetchcv;      /* signalled when that drops to 0 */
+	struct cv *sfs_loadcv;          /* signalled when a load finishes */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
+	struct bitmap *sfs_allocmap;    /* in use or reserved; not on disk */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirtymap; /* freemap blocks modified */
+	struct lock *sfs_freemaplock;   /* protects sfs_freemap*, sfs_sync* */
+	bool sfs_syncarmed;             /* background sync is scheduled */
+	bool sfs_syncoff;               /* unmounting; don't schedule it */
+	unsigned sfs_syncfails;         /* background syncs failed in a row */
+	unsigned sfs_syncs;             /* background syncs in flight */
+	struct cv *sfs_synccv;          /* signalled when that drops */
+	struct work sfs_syncjob;        /* the background sync */
+	struct sfs_journal *sfs_journal; /* metadata journal, or NULL */
 };
 
 /*
@@ -76,13 +167,53 @@ int sfs_mount(const char *device);
  */
 
 /* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(sfs, iov, uio, ptr, block, rw) \
+    uio_kinit(iov, uio, ptr, (sfs)->sfs_blocksize, \
+	      ((off_t)(block))*(sfs)->sfs_blocksize, rw)
 
 /* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
-int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
-int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
+int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);	/* uncached */
+int sfs_bread(struct sfs_fs *sfs, uint32_t block, struct buf **ret);
+int sfs_bget(struct sfs_fs *sfs, uint32_t block, struct buf **ret);
+int sfs_rblock(struct sfs_fs *sfs, void *data, size_t len, uint32_t block);
+int sfs_wblock(struct sfs_fs *sfs, void *data, size_t len, uint32_t block);
+
+/*
+ * Metadata journal (sfs_journal.c). Each operation between sfs_jbegin
+ * and sfs_jend may dirty at most SFS_JRESERVE metadata blocks; file
+ * writes are split into transactions of SFS_JWRITEBLOCKS blocks to
+ * stay under that. All of these do nothing useful (but are harmless)
+ * on a volume without a journal.
+ */
+#define SFS_JRESERVE      8
+#define SFS_JWRITEBLOCKS  4
+
+int sfs_jmount(struct sfs_fs *sfs);
+void sfs_junmount(struct sfs_fs *sfs);
+int sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *b, uint32_t block);
+bool sfs_jfree(struct sfs_fs *sfs, uint32_t block);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jtrycommit(struct sfs_fs *sfs);
+int sfs_jsync(struct sfs_fs *sfs);
+
+/*
+ * Schedule a background sync (sfs_fs.c) soon, to put the freemap in
+ * the buffer cache or commit the journal. Call with sfs_freemaplock
+ * held after changing either.
+ */
+void sfs_syncsoon(struct sfs_fs *sfs);
+
+/*
+ * Note that the freemap bit for BLOCK changed: mark the bitmap block
+ * holding it dirty and schedule a background sync. Call with
+ * sfs_freemaplock held.
+ */
+void sfs_freemap_dirty(struct sfs_fs *sfs, uint32_t block);
+
+/* Free unused vnodes kept on the inactive list (sfs_vnode.c). */
+void sfs_inactive_purge(struct sfs_fs *sfs);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
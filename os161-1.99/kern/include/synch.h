@@ -71,11 +71,22 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks do priority inheritance: while a thread is blocked in
+ * lock_acquire, the holder of the lock (and, if that thread is itself
+ * blocked on another lock, the holder of that one, and so on) runs
+ * with at least the blocked thread's priority. The boost is dropped
+ * in lock_release. lk_holder, lk_waiters and lk_nextheld are
+ * protected by a single global spinlock so the chain can be followed
+ * safely; see synch.c.
  */
 struct lock {
         char *lk_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *lk_wchan;
+	struct spinlock lk_lock;
+	struct thread *volatile lk_holder; /* thread holding it, or NULL */
+	struct thread *lk_waiters;	/* blocked threads, via t_pinext */
+	struct lock *lk_nextheld;	/* next in holder's t_heldlocks */
 };
 
 struct lock *lock_create(const char *name);
@@ -96,6 +107,13 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * Recompute the current thread's effective priority (t_pri) from its
+ * base priority and whatever it inherits through locks it holds.
+ * Called by thread_setpriority.
+ */
+void lock_update_priority(void);
+
 
 /*
  * Condition variable.
@@ -113,8 +131,7 @@ void lock_destroy(struct lock *);
 
 struct cv {
         char *cv_name;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+	struct wchan *cv_wchan;
 };
 
 struct cv *cv_create(const char *name);
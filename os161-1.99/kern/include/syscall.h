@@ -60,6 +60,12 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_readv(int fdesc, userptr_t uiov, int iovcnt, int *retval);
+int sys_writev(int fdesc, userptr_t uiov, int iovcnt, int *retval);
+int sys_preadv(int fdesc, userptr_t uiov, int iovcnt, off_t offset,
+	       int *retval);
+int sys_pwritev(int fdesc, userptr_t uiov, int iovcnt, off_t offset,
+		int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
@@ -52,6 +52,10 @@ int traffic_simulation(int, char **);
 int arraytest(int, char **);
 int bitmaptest(int, char **);
 int queuetest(int, char **);
+int copytest(int, char **);
+
+/* buffer cache test */
+int buftest(int, char **);
 
 /* thread tests */
 int threadtest(int, char **);
@@ -60,6 +64,7 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int pitest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -74,6 +79,7 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int nsconcstress(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -56,6 +57,15 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Thread priorities. Larger numbers are more important. The run
+ * queues and wait channels always pick the most important thread
+ * first (first come first served among equals).
+ */
+#define THREAD_PRI_MIN      0
+#define THREAD_PRI_DEFAULT  16
+#define THREAD_PRI_MAX      31
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -83,6 +93,33 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	bool t_bound;			/* Never migrate off t_cpu */
+	struct thread *t_allprev;	/* Links for list of all threads */
+	struct thread *t_allnext;	/* (protected by allthreads_lock) */
+
+	/*
+	 * Scheduling priority.
+	 *
+	 * t_basepri is the priority set with thread_setpriority; t_pri
+	 * is what the scheduler uses, which may be higher because of
+	 * priority inheritance from threads waiting on locks this
+	 * thread holds. The lock fields belong to synch.c and are
+	 * protected by its priority inheritance spinlock.
+	 */
+	int t_basepri;			/* Assigned priority */
+	volatile int t_pri;		/* Effective priority */
+	struct lock *t_waitlock;	/* Lock we're blocked on, if any */
+	struct thread *t_pinext;	/* Next waiter on t_waitlock */
+	struct lock *t_heldlocks;	/* Locks we hold, via lk_nextheld */
+
+	/*
+	 * Accounting, for the thread inspector (see <threadinfo.h>).
+	 * Written only by the thread itself; others may read them
+	 * without locking and get a slightly stale value.
+	 */
+	unsigned t_runticks;		/* hardclocks spent running */
+	unsigned t_volswitches;		/* times it slept or yielded */
+	unsigned t_involswitches;	/* times it was preempted */
 
 	/*
 	 * Interrupt state fields.
@@ -144,6 +181,21 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread starts on CPU and is never
+ * migrated away from it. Used for per-cpu service threads.
+ */
+int thread_fork_bound(const char *name, struct proc *proc, struct cpu *cpu,
+                      void (*func)(void *, unsigned long),
+                      void *data1, unsigned long data2);
+
+/*
+ * Set the current thread's base priority (THREAD_PRI_MIN to
+ * THREAD_PRI_MAX). New threads start with their creator's base
+ * priority.
+ */
+void thread_setpriority(int pri);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -157,6 +209,15 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Take a snapshot of every thread in the system for the thread
+ * inspector, filling in at most MAX entries of INFO. Returns the
+ * total number of threads, which may be larger than MAX. Only one
+ * spinlock is held while copying; running threads are not stopped.
+ */
+struct threadinfo;
+unsigned thread_snapshot(struct threadinfo *info, unsigned max);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -0,0 +1,42 @@
+#ifndef _THREADINFO_H_
+#define _THREADINFO_H_
+
+/*
+ * Thread inspector: ps/top-style snapshots of the thread system.
+ *
+ * A snapshot is a copy of the interesting fields of every thread,
+ * taken by thread_snapshot() with only the all-threads spinlock held.
+ * Other cpus keep running while it is taken, so the result is not
+ * an atomic picture of the system, just a consistent-enough one to
+ * see who is sleeping where and who is hogging the cpu.
+ *
+ * The snapshot is available as the "ps" menu command and by reading
+ * the "threads:" device.
+ */
+
+#include <thread.h>
+
+#define THREADINFO_NAMELEN 24
+
+struct threadinfo {
+	char ti_name[THREADINFO_NAMELEN];	/* t_name */
+	char ti_wchan[THREADINFO_NAMELEN];	/* t_wchan_name, or "" */
+	char ti_proc[THREADINFO_NAMELEN];	/* owning proc's name */
+	threadstate_t ti_state;			/* t_state */
+	unsigned ti_cpu;			/* t_cpu->c_number */
+	unsigned ti_runticks;			/* t_runticks */
+	unsigned ti_volswitches;		/* t_volswitches */
+	unsigned ti_involswitches;		/* t_involswitches */
+};
+
+/*
+ * Format a full report (per-cpu run queues, then one line per thread)
+ * into a freshly kmalloc'd string. The caller frees it.
+ * Returns an error code.
+ */
+int threadinfo_report(char **ret, size_t *retlen);
+
+/* Print the report on the console. */
+void threadinfo_print(void);
+
+#endif /* _THREADINFO_H_ */
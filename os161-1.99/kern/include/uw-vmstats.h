@@ -10,9 +10,10 @@
 /* Tracks stats on user programs */
 
 /* NOTE !!!!!! WARNING !!!!!
+ * The counts are kept in the per-cpu counters of cpustat.h.
  * All of the functions (except vmstats_print) whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * assume that interrupts are already off on the current cpu
+ * (e.g., because a spinlock is held).
  * All of the functions whose names do not begin
  * with '_' ensure atomicity locally (except vmstats_print).
  *
@@ -41,16 +42,16 @@
 /* ----------------------------------------------------------------------- */
 
 /* Initialize the statistics: must be called before using */
-void vmstats_init(void);                     /* uses locking */
-void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
+void vmstats_init(void);                     /* safe anywhere */
+void _vmstats_init(void);                    /* same as vmstats_init */
 
 /* Increment the specified count 
  * Example use: 
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
-void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
+void vmstats_inc(unsigned int index);    /* safe anywhere */
+void _vmstats_inc(unsigned int index);   /* interrupts must be off */
 
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
@@ -81,6 +81,37 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * VFS name cache (vfscache.c), used by vfs_lookup and vfs_lookparent
+ * for each path component. Maps (directory, name) to a vnode, or to
+ * nothing if the name is known not to exist.
+ *
+ *    vfscache_lookup    - Look up NAME in DIR. Returns true if cached,
+ *                         handing back a new reference to the vnode
+ *                         in RET, or NULL if the name doesn't exist.
+ *                         Otherwise, sets GEN for vfscache_enter.
+ *    vfscache_enter     - Record the result of looking up NAME in DIR
+ *                         after a miss: VN, or NULL for no such name.
+ *                         GEN is what vfscache_lookup returned; if
+ *                         anything was purged since, this does
+ *                         nothing.
+ *    vfscache_purge     - Forget NAME in DIR. Must be called after
+ *                         anything that may have changed what it
+ *                         refers to.
+ *    vfscache_purgefs   - Forget everything on filesystem FS.
+ *    vfscache_printstats - Print statistics.
+ *    vfscache_bootstrap - Set up at boot.
+ */
+
+bool vfscache_lookup(struct vnode *dir, const char *name,
+		     struct vnode **ret, unsigned *gen);
+void vfscache_enter(struct vnode *dir, const char *name,
+		    struct vnode *vn, unsigned gen);
+void vfscache_purge(struct vnode *dir, const char *name);
+void vfscache_purgefs(struct fs *fs);
+void vfscache_printstats(void);
+void vfscache_bootstrap(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because namei may destroy pathnames, these all may too.
@@ -184,13 +215,5 @@ int vfs_unmountall(void);
 DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
-/*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
- */
-void vfs_biglock_acquire(void);
-void vfs_biglock_release(void);
-bool vfs_biglock_do_i_hold(void);
-
 
 #endif /* _VFS_H_ */
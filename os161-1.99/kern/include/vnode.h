@@ -30,9 +30,11 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
+struct lock;
 
 /*
  * A struct vnode is an abstract representation of a file.
@@ -50,10 +52,23 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_refcount and vn_opencount are protected by vn_countlock. When
+ * VOP_DECREF finds the last reference it calls VOP_RECLAIM with the
+ * count still at 1; the filesystem must recheck it (under
+ * vn_countlock, while holding whatever lock it uses to find vnodes)
+ * and, if someone picked the vnode up again in the meantime, drop
+ * the count by one and return EBUSY.
+ *
+ * vn_openlock is held across the last VOP_DECOPEN's call to
+ * VOP_CLOSE, and VOP_INCOPEN takes it too, so nobody can open the
+ * vnode again while it's being closed.
  */
 struct vnode {
+	struct spinlock vn_countlock;   /* Lock for the counts */
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct lock *vn_openlock;       /* Serializes open and close */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -0,0 +1,69 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Kernel work queues.
+ *
+ * Each cpu has a queue of pending work and a fixed pool of worker
+ * threads bound to that cpu. Submitting work just links an item onto
+ * the current cpu's queue and wakes a worker, which is much cheaper
+ * than thread_fork (no stack allocation, no thread_create).
+ *
+ * Work functions run in an ordinary kernel thread, so they may sleep,
+ * but they share their worker with everything else queued on that
+ * cpu and should not block for long.
+ *
+ * There are two ways to use this:
+ *
+ *    - workqueue_submit(func, arg) allocates an item, runs it once,
+ *      and frees it. It may fail with ENOMEM.
+ *
+ *    - Embed a struct work in some other structure, set it up once
+ *      with work_init, and queue it with workqueue_queue as often as
+ *      needed. This never allocates, so it may be used from
+ *      interrupt handlers. Queueing an item that is already pending
+ *      fails with EBUSY, which conveniently coalesces repeated
+ *      requests for the same job.
+ *
+ * The _delayed variants run the item no sooner than TICKS hardclocks
+ * from now.
+ *
+ * An embedded item that is pending can be taken back off its queue
+ * with workqueue_cancel. That fails with ENOENT if it isn't pending,
+ * including if a worker has already picked it up to run, so the
+ * caller still has to wait for it in that case. Nothing may queue
+ * the item while it's being cancelled.
+ *
+ * Everything fails with ENXIO until workqueue_bootstrap has run.
+ */
+
+#include <spinlock.h>
+
+struct workqueue;	/* private to workqueue.c */
+
+struct work {
+	void (*w_func)(void *);	/* function to call */
+	void *w_arg;		/* argument to pass */
+	struct work *w_next;	/* link on queue */
+	unsigned w_expire;	/* hardclock count (delayed work only) */
+	volatile spinlock_data_t w_pending; /* currently on a queue */
+	struct workqueue *w_wq;	/* which queue, while pending */
+	bool w_allocated;	/* kfree after running */
+};
+
+void work_init(struct work *w, void (*func)(void *), void *arg);
+
+int workqueue_queue(struct work *w);
+int workqueue_queue_delayed(struct work *w, unsigned ticks);
+int workqueue_cancel(struct work *w);
+
+int workqueue_submit(void (*func)(void *), void *arg);
+int workqueue_submit_delayed(void (*func)(void *), void *arg, unsigned ticks);
+
+/* Create the queues and workers. Call after thread_start_cpus. */
+void workqueue_bootstrap(void);
+
+/* Release expired delayed work. Called from hardclock. */
+void workqueue_tick(void);
+
+#endif /* _WORKQUEUE_H_ */
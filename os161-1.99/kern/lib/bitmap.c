@@ -95,31 +95,68 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the first clear bit at or after START and before END.
+ *
+ * Full stretches are skipped a 32-bit chunk at a time. This doesn't
+ * break the byte-order independence described above: whether a
+ * chunk is all ones doesn't depend on how its bytes are ordered. (The
+ * data comes from kmalloc, so it is suitably aligned.)
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findclear(struct bitmap *b, unsigned start, unsigned end,
+                 unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        const uint32_t *chunks = (const uint32_t *)b->v;
+        unsigned bit, ix;
+        WORD_TYPE mask;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        bit = start;
+        while (bit < end) {
+                if (bit % 32 == 0 && bit + 32 <= end &&
+                    chunks[bit / 32] == 0xffffffff) {
+                        bit += 32;
+                        continue;
+                }
+                ix = bit / BITS_PER_WORD;
+                if (bit % BITS_PER_WORD == 0 && b->v[ix] == WORD_ALLBITS) {
+                        bit += BITS_PER_WORD;
+                        continue;
                 }
+                mask = ((WORD_TYPE)1) << (bit % BITS_PER_WORD);
+                if ((b->v[ix] & mask) == 0) {
+                        *index = bit;
+                        return 0;
+                }
+                bit++;
         }
         return ENOSPC;
 }
 
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        if (hint >= b->nbits) {
+                hint = 0;
+        }
+
+        /* Look from HINT to the end, then wrap around. */
+        if (bitmap_findclear(b, hint, b->nbits, index) &&
+            bitmap_findclear(b, 0, hint, index)) {
+                return ENOSPC;
+        }
+        KASSERT(*index < b->nbits);
+        bitmap_mark(b, *index);
+        return 0;
+}
+
 static
 inline
 void
@@ -119,17 +119,65 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 	return 0;
 }
 
+/*
+ * Zero kernel buffers in place, for uiomovezeros.
+ */
+static
+void
+uiozero_sysspace(size_t n, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t size;
+
+	KASSERT(uio->uio_space == NULL);
+
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+
+		if (size > n) {
+			size = n;
+		}
+
+		if (size == 0) {
+			/* move to the next iovec; see uiomove */
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			if (uio->uio_iovcnt == 0) {
+				panic("uiomovezeros: ran out of buffers\n");
+			}
+			continue;
+		}
+
+		bzero(iov->iov_kbase, size);
+		iov->iov_kbase = ((char *)iov->iov_kbase+size);
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		n -= size;
+	}
+}
+
 int
 uiomovezeros(size_t n, struct uio *uio)
 {
 	/* static, so initialized as zero */
-	static char zeros[16];
+	static char zeros[256];
 	size_t amt;
 	int result;
 
 	/* This only makes sense when reading */
 	KASSERT(uio->uio_rw == UIO_READ);
 
+	/*
+	 * Kernel buffers can just be cleared; user buffers have to be
+	 * copied out to, so send them zeros a chunk at a time.
+	 */
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		uiozero_sysspace(n, uio);
+		return 0;
+	}
+
 	while (n > 0) {
 		amt = sizeof(zeros);
 		if (amt > n) {
@@ -39,6 +39,7 @@
 #include <spl.h>
 #include <clock.h>
 #include <thread.h>
+#include <workqueue.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
@@ -46,6 +47,7 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -125,6 +127,8 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
+	buffer_flusher_start();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -36,10 +36,13 @@
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
+#include <threadinfo.h>
+#include <cpu.h>
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <buf.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-synchprobs.h"
@@ -405,6 +408,54 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpustat_print();
+
+	return 0;
+}
+
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	threadinfo_print();
+
+	return 0;
+}
+
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfscache_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -464,6 +515,8 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[bt]  Bitmap test                   ",
+	"[ct]  Copy test and benchmark       ",
+	"[bct] Buffer cache test             ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[tt1] Thread test 1                 ",
@@ -475,6 +528,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Priority inheritance test (1) ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -484,6 +538,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS namespace concurrency (4)  ",
 	NULL
 };
 
@@ -515,6 +570,10 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[cs] Per-cpu statistics             ",
+	"[ps] Thread status                  ",
+	"[bc] Buffer cache statistics        ",
+	"[nc] Name cache statistics          ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -572,10 +631,16 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cs",         cmd_cpustats },
+	{ "ps",         cmd_ps },
+	{ "bc",         cmd_bufstats },
+	{ "nc",         cmd_ncstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
+	{ "ct",		copytest },
+	{ "bct",	buftest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
 #if OPT_NET
@@ -589,6 +654,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	pitest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -600,6 +666,7 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	nsconcstress },
 
 	{ NULL, NULL }
 };
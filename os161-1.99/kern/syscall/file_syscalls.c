@@ -1,8 +1,11 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/iovec.h>
 #include <kern/unistd.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <syscall.h>
 #include <vnode.h>
 #include <vfs.h>
@@ -58,3 +61,138 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+/* handlers for readv(), writev(), preadv() and pwritev()   */
+/*
+ * n.b.
+ * Like write() above, these handle only the console: reads from
+ * standard input, and writes to standard output and standard error.
+ * The console can't seek, so preadv and pwritev get ESPIPE from
+ * VOP_TRYSEEK, which is what they should get for any unseekable file.
+ */
+
+/* Vectors up to this size are copied in on the stack. */
+#define RWV_STACKIOVS 8
+
+/* The byte count has to fit in the (signed) return value. */
+#define RWV_MAXTOTAL 0x7fffffff
+
+static
+int
+sys_rwv(int fdesc, userptr_t uiov, int iovcnt, off_t offset, bool seek,
+	enum uio_rw rw, int *retval)
+{
+  struct iovec stackiov[RWV_STACKIOVS];
+  struct iovec *iov;
+  struct uio u;
+  size_t total;
+  int i, res;
+
+  DEBUG(DB_SYSCALL,"Syscall: %sv(%d,%x,%d)\n",
+	rw == UIO_READ ? "read" : "write",
+	fdesc, (unsigned int)uiov, iovcnt);
+
+  if (rw == UIO_READ) {
+    if (fdesc != STDIN_FILENO) {
+      return EUNIMP;
+    }
+  }
+  else if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
+    return EUNIMP;
+  }
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  if (seek && offset < 0) {
+    return EINVAL;
+  }
+  KASSERT(curproc != NULL);
+  KASSERT(curproc->console != NULL);
+  KASSERT(curproc->p_addrspace != NULL);
+
+  if (seek) {
+    res = VOP_TRYSEEK(curproc->console, offset);
+    if (res) {
+      return res;
+    }
+  }
+
+  /* get the user's iovec array; the buffers it points to are
+     checked by uiomove as the data is moved */
+  if (iovcnt <= RWV_STACKIOVS) {
+    iov = stackiov;
+  }
+  else {
+    iov = kmalloc(iovcnt * sizeof(struct iovec));
+    if (iov == NULL) {
+      return ENOMEM;
+    }
+  }
+  res = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+  if (res) {
+    goto out;
+  }
+
+  total = 0;
+  for (i=0; i<iovcnt; i++) {
+    if (iov[i].iov_len > RWV_MAXTOTAL - total) {
+      res = EINVAL;
+      goto out;
+    }
+    total += iov[i].iov_len;
+  }
+
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_offset = seek ? offset : 0;
+  u.uio_resid = total;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(curproc->console,&u);
+  }
+  else {
+    res = VOP_WRITE(curproc->console,&u);
+  }
+  if (res) {
+    goto out;
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = total - u.uio_resid;
+  KASSERT(*retval >= 0);
+
+ out:
+  if (iov != stackiov) {
+    kfree(iov);
+  }
+  return res;
+}
+
+int
+sys_readv(int fdesc, userptr_t uiov, int iovcnt, int *retval)
+{
+  return sys_rwv(fdesc, uiov, iovcnt, 0, false, UIO_READ, retval);
+}
+
+int
+sys_writev(int fdesc, userptr_t uiov, int iovcnt, int *retval)
+{
+  return sys_rwv(fdesc, uiov, iovcnt, 0, false, UIO_WRITE, retval);
+}
+
+int
+sys_preadv(int fdesc, userptr_t uiov, int iovcnt, off_t offset,
+	   int *retval)
+{
+  return sys_rwv(fdesc, uiov, iovcnt, offset, true, UIO_READ, retval);
+}
+
+int
+sys_pwritev(int fdesc, userptr_t uiov, int iovcnt, off_t offset,
+	    int *retval)
+{
+  return sys_rwv(fdesc, uiov, iovcnt, offset, true, UIO_WRITE, retval);
+}
@@ -39,8 +39,8 @@ bitmaptest(int nargs, char **args)
 {
 	struct bitmap *b;
 	char data[TESTSIZE];
-	uint32_t x;
-	int i;
+	uint32_t x, hint;
+	int i, j;
 
 	(void)nargs;
 	(void)args;
@@ -101,6 +101,34 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/*
+	 * Now free a sparse scattering of bits (so whole 32-bit chunks
+	 * stay full) and check that bitmap_alloc_near finds the first
+	 * free one at or after the hint, wrapping around if need be.
+	 */
+	for (i=0; i<TESTSIZE; i++) {
+		data[i] = (random()%16 == 0);
+		if (data[i]) {
+			bitmap_unmark(b, i);
+		}
+	}
+	while (1) {
+		hint = random() % TESTSIZE;
+		for (j=0; j<TESTSIZE; j++) {
+			if (data[(hint + j) % TESTSIZE]) {
+				break;
+			}
+		}
+		if (j == TESTSIZE) {
+			KASSERT(bitmap_alloc_near(b, hint, &x) != 0);
+			break;
+		}
+		KASSERT(bitmap_alloc_near(b, hint, &x) == 0);
+		KASSERT(x == (hint + j) % TESTSIZE);
+		KASSERT(bitmap_isset(b, x));
+		data[x] = 0;
+	}
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,197 @@
+/*
+ * Tests and microbenchmark for the block copy routines (memcpy,
+ * memmove, bzero) that uiomove, copyin, and copyout run on.
+ *
+ * The test part tries every combination of source and destination
+ * alignment for short lengths and checks the result byte by byte,
+ * including the bytes on either side that shouldn't be touched. The
+ * benchmark part times large copies at several alignments and prints
+ * the throughput in bytes per CPU cycle.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <test.h>
+
+/* Size of the buffers used for the correctness checks. */
+#define CHECKSIZE	96
+
+/* Largest length and misalignment tried in the correctness checks. */
+#define CHECKMAXLEN	64
+#define CHECKMAXOFF	8
+
+/* Size of each benchmark transfer, and how many of them are timed. */
+#define BENCHSIZE	4096
+#define BENCHITERS	256
+
+/* System/161's CPU runs at 25 MHz; see lamebus_machdep.c. */
+#define NSECS_PER_CYCLE	40
+
+static
+void
+fill(unsigned char *buf, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (unsigned char)(seed + i*7);
+	}
+}
+
+static
+bool
+same(const unsigned char *a, const unsigned char *b, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Check memcpy, memmove, and bzero on all short lengths and
+ * alignments against byte-at-a-time reference results.
+ */
+static
+void
+copytest_check(void)
+{
+	unsigned char src[CHECKSIZE], dst[CHECKSIZE], ref[CHECKSIZE];
+	unsigned soff, doff, len, i;
+
+	kprintf("Checking memcpy, memmove, and bzero...\n");
+
+	for (soff=0; soff<CHECKMAXOFF; soff++) {
+		for (doff=0; doff<CHECKMAXOFF; doff++) {
+			for (len=0; len<=CHECKMAXLEN; len++) {
+
+				/* memcpy between separate buffers */
+				fill(src, CHECKSIZE, len);
+				fill(dst, CHECKSIZE, len + 101);
+				memcpy(ref, dst, CHECKSIZE);
+				for (i=0; i<len; i++) {
+					ref[doff+i] = src[soff+i];
+				}
+				memcpy(dst+doff, src+soff, len);
+				KASSERT(same(dst, ref, CHECKSIZE));
+
+				/* memmove within one buffer */
+				fill(dst, CHECKSIZE, len + 53);
+				for (i=0; i<len; i++) {
+					src[i] = dst[soff+i];
+				}
+				memcpy(ref, dst, CHECKSIZE);
+				for (i=0; i<len; i++) {
+					ref[doff+i] = src[i];
+				}
+				memmove(dst+doff, dst+soff, len);
+				KASSERT(same(dst, ref, CHECKSIZE));
+			}
+		}
+	}
+
+	for (doff=0; doff<CHECKMAXOFF; doff++) {
+		for (len=0; len<=CHECKMAXLEN; len++) {
+			fill(dst, CHECKSIZE, len);
+			memcpy(ref, dst, CHECKSIZE);
+			for (i=0; i<len; i++) {
+				ref[doff+i] = 0;
+			}
+			bzero(dst+doff, len);
+			KASSERT(same(dst, ref, CHECKSIZE));
+		}
+	}
+}
+
+/*
+ * Print the throughput of BENCHITERS transfers of LEN bytes that
+ * took SECS/NSECS.
+ */
+static
+void
+copytest_report(const char *what, size_t len, time_t secs, uint32_t nsecs)
+{
+	uint32_t cycles, bytes, rate;
+
+	cycles = (uint32_t)secs * (1000000000 / NSECS_PER_CYCLE)
+		+ nsecs / NSECS_PER_CYCLE;
+	if (cycles == 0) {
+		cycles = 1;
+	}
+	bytes = len * BENCHITERS;
+
+	/* In hundredths of a byte per cycle. */
+	rate = bytes * 100 / cycles;
+	kprintf("  %-28s %u.%02u bytes/cycle\n", what, rate / 100, rate % 100);
+}
+
+static
+void
+copytest_bench(unsigned char *src, unsigned char *dst,
+	       unsigned soff, unsigned doff, const char *what)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	size_t len = BENCHSIZE - CHECKMAXOFF;
+	unsigned i;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<BENCHITERS; i++) {
+		memcpy(dst+doff, src+soff, len);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	copytest_report(what, len, secs, nsecs);
+}
+
+int
+copytest(int nargs, char **args)
+{
+	unsigned char *src, *dst;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting copy test...\n");
+
+	copytest_check();
+
+	src = kmalloc(BENCHSIZE);
+	dst = kmalloc(BENCHSIZE);
+	if (src == NULL || dst == NULL) {
+		kfree(src);
+		kfree(dst);
+		kprintf("copytest: Out of memory\n");
+		return ENOMEM;
+	}
+	fill(src, BENCHSIZE, 0);
+
+	kprintf("Timing %u copies of %u bytes:\n",
+		BENCHITERS, BENCHSIZE - CHECKMAXOFF);
+	copytest_bench(src, dst, 0, 0, "memcpy, aligned");
+	copytest_bench(src, dst, 1, 1, "memcpy, equally misaligned");
+	copytest_bench(src, dst, 1, 2, "memcpy, differently aligned");
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<BENCHITERS; i++) {
+		bzero(dst, BENCHSIZE);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	copytest_report("bzero, aligned", BENCHSIZE, secs, nsecs);
+
+	kfree(src);
+	kfree(dst);
+
+	kprintf("Copy test done.\n");
+	return 0;
+}
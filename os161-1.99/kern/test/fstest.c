@@ -537,6 +537,146 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Concurrent namespace operations, after testbin/dirconc. SFS has no
+ * subdirectories, so instead of mkdir and rmdir the threads create,
+ * rename, and remove files in the root directory, using only a few
+ * names so they collide all the time. Errors that the races make
+ * legitimate are ignored; anything else is reported. Afterwards all
+ * the names are removed and must then be gone.
+ */
+
+#define NSCONC_NGROUPS	3	/* threads: 4 per group */
+#define NSCONC_NTRIES	100
+#define NSCONC_NNAMES	4
+
+static const char *const nsconc_names[NSCONC_NNAMES] = {
+	"nsconc.aaaa", "nsconc.bbbb", "nsconc.cccc", "nsconc.dddd",
+};
+
+static unsigned nsconc_errors[NSCONC_NGROUPS * 4];
+
+static
+void
+nsconc_name(char *buf, size_t len, const char *fs, unsigned which)
+{
+	snprintf(buf, len, "%s:%s", fs, nsconc_names[which]);
+	KASSERT(strlen(buf) < len);
+}
+
+static
+void
+nsconc_thread(void *fs, unsigned long num)
+{
+	char name1[32], name2[32];
+	struct vnode *vn;
+	const char *op;
+	int i, err;
+
+	for (i=0; i<NSCONC_NTRIES; i++) {
+		nsconc_name(name1, sizeof(name1), fs,
+			    random() % NSCONC_NNAMES);
+		switch (num % 4) {
+		    case 0:
+		    case 1:
+			op = "create";
+			err = vfs_open(name1, O_WRONLY|O_CREAT, 0664, &vn);
+			if (err == 0) {
+				vfs_close(vn);
+			}
+			break;
+		    case 2:
+			op = "rename";
+			nsconc_name(name2, sizeof(name2), fs,
+				    random() % NSCONC_NNAMES);
+			err = vfs_rename(name1, name2);
+			if (err == ENOENT || err == EEXIST) {
+				err = 0;
+			}
+			break;
+		    default:
+			op = "remove";
+			err = vfs_remove(name1);
+			if (err == ENOENT) {
+				err = 0;
+			}
+			break;
+		}
+		if (err) {
+			kprintf("*** Thread %lu: %s: %s\n",
+				num, op, strerror(err));
+			nsconc_errors[num]++;
+		}
+	}
+
+	V(threadsem);
+}
+
+static
+void
+donsconcstress(const char *filesys)
+{
+	char name[32];
+	struct vnode *vn;
+	unsigned i, errs;
+	int err;
+
+	init_threadsem();
+
+	kprintf("*** Starting fs namespace concurrency test on %s:\n",
+		filesys);
+
+	for (i=0; i<NSCONC_NGROUPS * 4; i++) {
+		nsconc_errors[i] = 0;
+#ifdef UW
+		err = thread_fork("nsconc", NULL,
+				  nsconc_thread, (char *)filesys, i);
+#else
+		err = thread_fork("nsconc",
+				  nsconc_thread, (char *)filesys, i,
+				  NULL);
+#endif
+		if (err) {
+			panic("nsconcstress: thread_fork failed %s\n",
+			      strerror(err));
+		}
+	}
+
+	for (i=0; i<NSCONC_NGROUPS * 4; i++) {
+		P(threadsem);
+	}
+	errs = 0;
+	for (i=0; i<NSCONC_NGROUPS * 4; i++) {
+		errs += nsconc_errors[i];
+	}
+
+	for (i=0; i<NSCONC_NNAMES; i++) {
+		nsconc_name(name, sizeof(name), filesys, i);
+		err = vfs_remove(name);
+		if (err && err != ENOENT) {
+			kprintf("*** cleanup: remove %s: %s\n",
+				nsconc_names[i], strerror(err));
+			errs++;
+		}
+		nsconc_name(name, sizeof(name), filesys, i);
+		err = vfs_open(name, O_RDONLY, 0664, &vn);
+		if (err == 0) {
+			kprintf("*** cleanup: %s still there\n",
+				nsconc_names[i]);
+			vfs_close(vn);
+			errs++;
+		}
+	}
+
+	if (errs > 0) {
+		kprintf("*** fs namespace concurrency test: %u errors\n",
+			errs);
+	}
+	kprintf("*** fs namespace concurrency test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -544,7 +684,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +716,7 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(nsconcstress);
 
 ////////////////////////////////////////////////////////////
 
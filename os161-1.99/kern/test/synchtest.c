@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 
@@ -68,6 +69,10 @@ cleanitems(void)
 	lock_destroy(testlock);
 	cv_destroy(testcv);
 	sem_destroy(donesem);
+	testsem = NULL;
+	testlock = NULL;
+	testcv = NULL;
+	donesem = NULL;
 	}
 #endif
 
@@ -347,3 +352,173 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+//
+// Priority inheritance test.
+//
+// A low-priority thread takes a lock; then several medium-priority
+// threads start spinning, and a high-priority thread tries to take
+// the lock. Without priority inheritance the low thread can't run
+// until the spinners are done, so the high thread waits about
+// PI_SPINMS. With it, the low thread is boosted, finishes its short
+// critical section (PI_HOLDMS), and the high thread gets the lock
+// almost at once. All the threads are bound to the current cpu so
+// they really compete for it.
+
+#define PI_NSPINNERS  3
+#define PI_SPINMS     1000
+#define PI_HOLDMS     20
+
+#define PI_LOW   (THREAD_PRI_MIN + 1)
+#define PI_MED   (THREAD_PRI_DEFAULT)
+#define PI_HIGH  (THREAD_PRI_MAX - 1)
+
+static struct lock *pilock;
+static struct semaphore *pisem;
+static volatile unsigned pi_waitms;
+
+/*
+ * Milliseconds since the time SECS/NSECS.
+ */
+static
+unsigned
+pi_elapsedms(time_t secs, uint32_t nsecs)
+{
+	time_t nowsecs, dsecs;
+	uint32_t nownsecs, dnsecs;
+
+	gettime(&nowsecs, &nownsecs);
+	getinterval(secs, nsecs, nowsecs, nownsecs, &dsecs, &dnsecs);
+	return dsecs * 1000 + dnsecs / 1000000;
+}
+
+/*
+ * Burn the cpu for MS milliseconds (of wall time).
+ */
+static
+void
+pi_spin(unsigned ms)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	while (pi_elapsedms(secs, nsecs) < ms) {
+		/* nothing */
+	}
+}
+
+static
+void
+pi_lowthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(pilock);
+	V(pisem);
+	thread_setpriority(PI_LOW);
+	pi_spin(PI_HOLDMS);
+	lock_release(pilock);
+	V(donesem);
+}
+
+static
+void
+pi_medthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_MED);
+	pi_spin(PI_SPINMS);
+	V(donesem);
+}
+
+static
+void
+pi_highthread(void *junk, unsigned long num)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_HIGH);
+	gettime(&secs, &nsecs);
+	lock_acquire(pilock);
+	pi_waitms = pi_elapsedms(secs, nsecs);
+	lock_release(pilock);
+	V(donesem);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	int oldpri, result;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	pilock = lock_create("pilock");
+	pisem = sem_create("pisem", 0);
+	if (pilock == NULL || pisem == NULL) {
+		panic("pitest: out of memory\n");
+	}
+
+	kprintf("Starting priority inheritance test...\n");
+
+	/* Stay above everyone so we can set the scene undisturbed. */
+	oldpri = curthread->t_basepri;
+	thread_setpriority(THREAD_PRI_MAX);
+
+	result = thread_fork_bound("pitest-low", NULL, curcpu,
+				   pi_lowthread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	/* Wait until it holds the lock. */
+	P(pisem);
+
+	for (i=0; i<PI_NSPINNERS; i++) {
+		result = thread_fork_bound("pitest-med", NULL, curcpu,
+					   pi_medthread, NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork_bound("pitest-high", NULL, curcpu,
+				   pi_highthread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	for (i=0; i<PI_NSPINNERS + 2; i++) {
+		P(donesem);
+	}
+	thread_setpriority(oldpri);
+
+	kprintf("High-priority thread waited %u ms for the lock "
+		"(holder needs %u ms, spinners run for %u ms)\n",
+		pi_waitms, PI_HOLDMS, PI_SPINMS);
+	if (pi_waitms >= PI_SPINMS / 2) {
+		kprintf("pitest: FAILED: priority inversion not bounded\n");
+	}
+	else {
+		kprintf("pitest: SUCCESS\n");
+	}
+
+	lock_destroy(pilock);
+	sem_destroy(pisem);
+#ifdef UW
+	cleanitems();
+#endif
+	kprintf("Priority inheritance test done\n");
+
+	return 0;
+}
@@ -120,12 +120,16 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if (!curcpu->c_isidle) {
+		curthread->t_runticks++;
+	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
+	workqueue_tick();
 	thread_yield();
 }
 
@@ -0,0 +1,134 @@
+/*
+ * Per-cpu statistics counters.
+ *
+ * See <cpustat.h> for the interface. The counters themselves live in
+ * struct cpu; this file only knows how to bump them and how to add
+ * them up.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <cpustat.h>
+
+/* Names for the single counters, in index order. */
+static const char *const cpustat_names[CPUSTAT_VM_BASE] = {
+	"Context switches",
+	"IPIs",
+	"Timer interrupts",
+};
+
+/*
+ * Increment a counter, taking care of the spl ourselves.
+ */
+void
+cpustat_inc(unsigned index)
+{
+	int spl;
+
+	KASSERT(index < CPUSTAT_COUNT);
+
+	spl = splhigh();
+	curcpu->c_stats[index]++;
+	splx(spl);
+}
+
+/*
+ * Increment a counter. Interrupts must already be off on this cpu.
+ */
+void
+_cpustat_inc(unsigned index)
+{
+	KASSERT(index < CPUSTAT_COUNT);
+
+	curcpu->c_stats[index]++;
+}
+
+/*
+ * Return one cpu's value for a counter.
+ */
+unsigned
+cpustat_getcpu(unsigned cpunum, unsigned index)
+{
+	KASSERT(index < CPUSTAT_COUNT);
+
+	return cpu_get(cpunum)->c_stats[index];
+}
+
+/*
+ * Return the sum of a counter over all cpus.
+ */
+unsigned
+cpustat_get(unsigned index)
+{
+	unsigned i, numcpus, total;
+
+	KASSERT(index < CPUSTAT_COUNT);
+
+	total = 0;
+	numcpus = cpu_count();
+	for (i=0; i<numcpus; i++) {
+		total += cpu_get(i)->c_stats[index];
+	}
+	return total;
+}
+
+/*
+ * Print one counter line if it is nonzero: the total followed by the
+ * value on each cpu.
+ */
+static
+void
+cpustat_printone(const char *name, unsigned num, unsigned index)
+{
+	char buf[32];
+	unsigned i, numcpus, total;
+
+	total = cpustat_get(index);
+	if (total == 0) {
+		return;
+	}
+
+	if (name == NULL) {
+		snprintf(buf, sizeof(buf), "%u", num);
+		name = buf;
+	}
+
+	kprintf("%-24s %10u:", name, total);
+	numcpus = cpu_count();
+	for (i=0; i<numcpus; i++) {
+		kprintf(" %u", cpustat_getcpu(i, index));
+	}
+	kprintf("\n");
+}
+
+/*
+ * Print everything.
+ */
+void
+cpustat_print(void)
+{
+	unsigned i;
+
+	kprintf("%-24s %10s: per-cpu\n", "Counter", "Total");
+	for (i=0; i<CPUSTAT_VM_BASE; i++) {
+		cpustat_printone(cpustat_names[i], 0, i);
+	}
+
+	kprintf("Traps by exception code:\n");
+	for (i=0; i<CPUSTAT_NTRAPS; i++) {
+		cpustat_printone(NULL, i, CPUSTAT_TRAP(i));
+	}
+
+	kprintf("Interrupts by bus slot:\n");
+	for (i=0; i<CPUSTAT_NIRQS; i++) {
+		cpustat_printone(NULL, i, CPUSTAT_IRQ(i));
+	}
+
+	kprintf("System calls by number:\n");
+	for (i=0; i<CPUSTAT_NSYSCALLS; i++) {
+		cpustat_printone(NULL, i, CPUSTAT_SYSCALL(i));
+	}
+}
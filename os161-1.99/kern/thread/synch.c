@@ -146,6 +146,100 @@ V(struct semaphore *sem)
 ////////////////////////////////////////////////////////////
 //
 // Lock.
+//
+// Locks do priority inheritance. The holder of a lock and the threads
+// blocked on it are recorded (lk_holder, lk_waiters), each thread
+// records the lock it is blocked on (t_waitlock) and the locks it
+// holds (t_heldlocks), and a thread blocking in lock_acquire raises
+// the effective priority (t_pri) of every thread along the chain of
+// holders in front of it. When a thread releases a lock it recomputes
+// its own priority from its base priority and the waiters on the
+// locks it still holds.
+//
+// All of that cross-thread state is protected by pi_lock, a single
+// global spinlock, so following a chain never needs more than one
+// lock. It is only ever held briefly. Lock ordering: a lock's lk_lock,
+// then pi_lock; the wchan and run queue locks are never taken while
+// pi_lock is held.
+
+/* Protects PI state; see above. */
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+
+/* Longest holder chain we'll follow; guards against deadlock cycles. */
+#define PI_MAXDEPTH 16
+
+/*
+ * Return the priority thread T should run at: its base priority, or
+ * the highest priority of any thread waiting on a lock it holds.
+ * pi_lock must be held.
+ */
+static
+int
+pi_compute(struct thread *t)
+{
+	struct lock *lk;
+	struct thread *w;
+	int pri;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	pri = t->t_basepri;
+	for (lk = t->t_heldlocks; lk != NULL; lk = lk->lk_nextheld) {
+		for (w = lk->lk_waiters; w != NULL; w = w->t_pinext) {
+			if (w->t_pri > pri) {
+				pri = w->t_pri;
+			}
+		}
+	}
+	return pri;
+}
+
+/*
+ * Donate priority PRI to the holder of LOCK, and on down the chain if
+ * that holder is itself blocked. Stops as soon as it finds a thread
+ * that's already running at PRI or better. pi_lock must be held.
+ *
+ * The holder can't go away under us: a thread can't exit while it
+ * holds a lock, and lk_holder only changes with pi_lock held.
+ */
+static
+void
+pi_donate(struct lock *lock, int pri)
+{
+	struct thread *holder;
+	unsigned depth;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	for (depth = 0; lock != NULL && depth < PI_MAXDEPTH; depth++) {
+		holder = lock->lk_holder;
+		if (holder == NULL || holder->t_pri >= pri) {
+			break;
+		}
+		holder->t_pri = pri;
+		lock = holder->t_waitlock;
+	}
+}
+
+/*
+ * Take the current thread off LOCK's waiter list. pi_lock must be held.
+ */
+static
+void
+pi_unwait(struct lock *lock)
+{
+	struct thread **pt;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+	KASSERT(curthread->t_waitlock == lock);
+
+	for (pt = &lock->lk_waiters; *pt != curthread; pt = &(*pt)->t_pinext) {
+		KASSERT(*pt != NULL);
+	}
+	*pt = curthread->t_pinext;
+	curthread->t_pinext = NULL;
+	curthread->t_waitlock = NULL;
+}
 
 struct lock *
 lock_create(const char *name)
@@ -162,9 +256,19 @@ lock_create(const char *name)
                 kfree(lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	lock->lk_wchan = wchan_create(lock->lk_name);
+	if (lock->lk_wchan == NULL) {
+		kfree(lock->lk_name);
+		kfree(lock);
+		return NULL;
+	}
+
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	lock->lk_waiters = NULL;
+	lock->lk_nextheld = NULL;
+
         return lock;
 }
 
@@ -172,9 +276,11 @@ void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_waiters == NULL);
 
-        // add stuff here as needed
-        
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
         kfree(lock);
 }
@@ -182,27 +288,102 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	int pri;
+	struct thread *w;
+
+	KASSERT(lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(lock->lk_holder != curthread);
+
+	spinlock_acquire(&lock->lk_lock);
+	while (lock->lk_holder != NULL) {
+		/*
+		 * Register as a waiter (once) and push our priority
+		 * down the chain. Redo the donation every time round,
+		 * since someone other than the thread we last donated
+		 * to may have got the lock in the meantime.
+		 */
+		spinlock_acquire(&pi_lock);
+		if (curthread->t_waitlock == NULL) {
+			curthread->t_waitlock = lock;
+			curthread->t_pinext = lock->lk_waiters;
+			lock->lk_waiters = curthread;
+		}
+		pi_donate(lock, curthread->t_pri);
+		spinlock_release(&pi_lock);
+
+		/* Same handoff as in P(). */
+		wchan_lock(lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+		wchan_sleep(lock->lk_wchan);
+
+		spinlock_acquire(&lock->lk_lock);
+	}
+
+	spinlock_acquire(&pi_lock);
+	if (curthread->t_waitlock != NULL) {
+		pi_unwait(lock);
+	}
+	lock->lk_holder = curthread;
+	lock->lk_nextheld = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+
+	/*
+	 * Inherit from anyone still asleep on the lock; they donated
+	 * to the previous holder, not to us.
+	 */
+	pri = curthread->t_pri;
+	for (w = lock->lk_waiters; w != NULL; w = w->t_pinext) {
+		if (w->t_pri > pri) {
+			pri = w->t_pri;
+		}
+	}
+	curthread->t_pri = pri;
+	spinlock_release(&pi_lock);
 
-        (void)lock;  // suppress warning until code gets written
+	spinlock_release(&lock->lk_lock);
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
+	struct lock **pl;
 
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(lock != NULL);
+	KASSERT(lock->lk_holder == curthread);
+
+	spinlock_acquire(&lock->lk_lock);
+
+	spinlock_acquire(&pi_lock);
+	lock->lk_holder = NULL;
+	for (pl = &curthread->t_heldlocks; *pl != lock;
+	     pl = &(*pl)->lk_nextheld) {
+		KASSERT(*pl != NULL);
+	}
+	*pl = lock->lk_nextheld;
+	lock->lk_nextheld = NULL;
+	curthread->t_pri = pi_compute(curthread);
+	spinlock_release(&pi_lock);
+
+	/* wchan_wakeone picks the highest-priority sleeper. */
+	wchan_wakeone(lock->lk_wchan);
+	spinlock_release(&lock->lk_lock);
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
+	KASSERT(lock != NULL);
 
-        (void)lock;  // suppress warning until code gets written
+	return lock->lk_holder == curthread;
+}
 
-        return true; // dummy until code gets written
+void
+lock_update_priority(void)
+{
+	spinlock_acquire(&pi_lock);
+	curthread->t_pri = pi_compute(curthread);
+	spinlock_release(&pi_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -225,9 +406,14 @@ cv_create(const char *name)
                 kfree(cv);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
+
+	cv->cv_wchan = wchan_create(cv->cv_name);
+	if (cv->cv_wchan == NULL) {
+		kfree(cv->cv_name);
+		kfree(cv);
+		return NULL;
+	}
+
         return cv;
 }
 
@@ -236,8 +422,8 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
-        
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
         kfree(cv);
 }
@@ -245,23 +431,33 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-        // Write this
-        (void)cv;    // suppress warning until code gets written
-        (void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	/*
+	 * Lock the wchan before letting go of the lock, so a signal
+	 * sent right after we release can't be missed.
+	 */
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	wchan_sleep(cv->cv_wchan);
+	lock_acquire(lock);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeone(cv->cv_wchan);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-	(void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
+	KASSERT(cv != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_wakeall(cv->cv_wchan);
 }
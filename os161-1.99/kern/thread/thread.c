@@ -44,6 +44,7 @@
 #include <thread.h>
 #include <threadlist.h>
 #include <threadprivate.h>
+#include <threadinfo.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
@@ -72,6 +73,19 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * List of all threads that exist, for the thread inspector. Threads
+ * are added in thread_create and removed in thread_destroy. This is
+ * a plain linked list through t_allprev/t_allnext rather than a
+ * threadlist because t_listnode is already used for the run queue,
+ * wait channels, and zombie list.
+ */
+static struct thread *allthreads;
+static unsigned allthreads_count;
+static struct spinlock allthreads_lock = SPINLOCK_INITIALIZER;
+
+static void thread_reap(void *cpu);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +125,84 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Give THREAD a kernel stack.
+ *
+ * Stacks of dead threads are kept in a small per-cpu cache so that
+ * thread_fork usually doesn't have to go to kmalloc for a whole
+ * STACK_SIZE block. Cached stacks still have their guard band from
+ * thread_checkstack_init (it was checked when they were put back), so
+ * they can be handed out as is. The cache belongs to the cpu and is
+ * only touched with interrupts off, so it needs no lock.
+ */
+static
+int
+thread_stack_get(struct thread *thread)
+{
+	int spl;
+
+	KASSERT(thread->t_stack == NULL);
+
+	spl = splhigh();
+	if (curcpu->c_nstacks > 0) {
+		thread->t_stack = curcpu->c_stacks[--curcpu->c_nstacks];
+	}
+	splx(spl);
+
+	if (thread->t_stack == NULL) {
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			return ENOMEM;
+		}
+		thread_checkstack_init(thread);
+	}
+	return 0;
+}
+
+/*
+ * Take THREAD's stack away from it and put it in the current cpu's
+ * stack cache, if there's room. If the cache is full, leave the
+ * thread its stack and return false. Never allocates or frees, so
+ * it's safe in the context switch path. The thread must not be
+ * running (or be about to run) on its stack any more.
+ */
+static
+bool
+thread_stack_cache(struct thread *thread)
+{
+	bool cached = false;
+	int spl;
+
+	if (thread->t_stack == NULL) {
+		return true;
+	}
+	thread_checkstack(thread);
+
+	spl = splhigh();
+	if (curcpu->c_nstacks < CPU_STACKCACHE) {
+		curcpu->c_stacks[curcpu->c_nstacks++] = thread->t_stack;
+		thread->t_stack = NULL;
+		cached = true;
+	}
+	splx(spl);
+
+	return cached;
+}
+
+/*
+ * Take THREAD's stack away from it and put it in the current cpu's
+ * stack cache, or free it if the cache is full.
+ */
+static
+void
+thread_stack_put(struct thread *thread)
+{
+	if (!thread_stack_cache(thread)) {
+		kfree(thread->t_stack);
+		thread->t_stack = NULL;
+	}
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -143,6 +235,19 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_bound = false;
+
+	/* Scheduling fields */
+	thread->t_basepri = THREAD_PRI_DEFAULT;
+	thread->t_pri = THREAD_PRI_DEFAULT;
+	thread->t_waitlock = NULL;
+	thread->t_pinext = NULL;
+	thread->t_heldlocks = NULL;
+
+	/* Accounting fields */
+	thread->t_runticks = 0;
+	thread->t_volswitches = 0;
+	thread->t_involswitches = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -151,6 +256,17 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	/* Make it visible to the thread inspector. */
+	spinlock_acquire(&allthreads_lock);
+	thread->t_allprev = NULL;
+	thread->t_allnext = allthreads;
+	if (allthreads != NULL) {
+		allthreads->t_allprev = thread;
+	}
+	allthreads = thread;
+	allthreads_count++;
+	spinlock_release(&allthreads_lock);
+
 	return thread;
 }
 
@@ -180,6 +296,10 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	bzero(c->c_stats, sizeof(c->c_stats));
+	work_init(&c->c_reapwork, thread_reap, c);
+	c->c_nstacks = 0;
+	c->c_workqueue = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -227,6 +347,25 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Return the cpu with software number SOFTWARE_NUMBER.
+ */
+struct cpu *
+cpu_get(unsigned software_number)
+{
+	KASSERT(software_number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, software_number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -247,11 +386,27 @@ thread_destroy(struct thread *thread)
 	 * either here or in thread_exit(). (And not both...)
 	 */
 
+	/* Take it off the list of all threads first. */
+	spinlock_acquire(&allthreads_lock);
+	if (thread->t_allprev != NULL) {
+		thread->t_allprev->t_allnext = thread->t_allnext;
+	}
+	else {
+		KASSERT(allthreads == thread);
+		allthreads = thread->t_allnext;
+	}
+	if (thread->t_allnext != NULL) {
+		thread->t_allnext->t_allprev = thread->t_allprev;
+	}
+	KASSERT(allthreads_count > 0);
+	allthreads_count--;
+	spinlock_release(&allthreads_lock);
+
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	KASSERT(thread->t_heldlocks == NULL);
+	KASSERT(thread->t_waitlock == NULL);
+	thread_stack_put(thread);
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -262,17 +417,79 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Work function (c_reapwork) that cleans up zombies for exorcise.
+ * It runs in one of the cpu's own bound workers, so the zombie list,
+ * which belongs to the cpu, only needs interrupts off to touch.
+ */
+static
+void
+thread_reap(void *data)
+{
+	struct cpu *c = data;
+	struct threadlist victims;
+	struct thread *z;
+	int spl;
+
+	KASSERT(curthread->t_bound);
+	KASSERT(curcpu->c_self == c);
+
+	threadlist_init(&victims);
+	spl = splhigh();
+	while ((z = threadlist_remhead(&c->c_zombies)) != NULL) {
+		threadlist_addtail(&victims, z);
+	}
+	splx(spl);
+
+	while ((z = threadlist_remhead(&victims)) != NULL) {
+		KASSERT(z != curthread);
+		KASSERT(z->t_state == S_ZOMBIE);
+		thread_destroy(z);
+	}
+	threadlist_cleanup(&victims);
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
  *
  * The list of zombies is per-cpu.
+ *
+ * Once the cpu has a work queue, the freeing is handed off to
+ * thread_reap so it doesn't happen here in the middle of the context
+ * switch with interrupts off. Before that (early boot) do it inline.
  */
 static
 void
 exorcise(void)
 {
 	struct thread *z;
+	int result;
+
+	if (threadlist_isempty(&curcpu->c_zombies)) {
+		return;
+	}
+
+	/*
+	 * The zombies are completely off their stacks now, so take
+	 * the stacks back right away, while they're still warm in the
+	 * cache; the next thread_fork on this cpu can use one at once.
+	 * Stacks that don't fit stay with their zombies and are freed
+	 * by thread_destroy, outside the switch path.
+	 */
+	THREADLIST_FORALL(z, curcpu->c_zombies) {
+		if (!thread_stack_cache(z)) {
+			break;
+		}
+	}
+
+	if (curcpu->c_workqueue != NULL) {
+		result = workqueue_queue(&curcpu->c_reapwork);
+		if (result == 0 || result == EBUSY) {
+			/* Queued, or already queued. */
+			return;
+		}
+	}
 
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
@@ -426,6 +643,36 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Remove and return the most important thread on a run queue or wait
+ * channel list, or NULL if it's empty. Among threads of equal
+ * priority the one nearest the head (the one that has waited
+ * longest) wins, so with all priorities equal this is just
+ * threadlist_remhead.
+ *
+ * Picking at removal time rather than keeping the list sorted means
+ * a priority change (e.g. from priority inheritance) on a thread
+ * that's already queued takes effect without having to find and
+ * move it.
+ */
+static
+struct thread *
+thread_remhighest(struct threadlist *tl)
+{
+	struct thread *t, *best;
+
+	best = NULL;
+	THREADLIST_FORALL(t, *tl) {
+		if (best == NULL || t->t_pri > best->t_pri) {
+			best = t;
+		}
+	}
+	if (best != NULL) {
+		threadlist_remove(tl, best);
+	}
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -465,20 +712,16 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Common code for thread_fork and thread_fork_bound: create a new
+ * thread based on the current one and make it runnable on CPU.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_fork_common(const char *name,
+		   struct proc *proc,
+		   struct cpu *cpu, bool bound,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
@@ -493,19 +736,21 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
+	result = thread_stack_get(newthread);
+	if (result) {
 		thread_destroy(newthread);
-		return ENOMEM;
+		return result;
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = cpu;
+	newthread->t_bound = bound;
+	newthread->t_basepri = curthread->t_basepri;
+	newthread->t_pri = curthread->t_basepri;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -528,12 +773,46 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the target cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, curthread->t_cpu, false,
+				  entrypoint, data1, data2);
+}
+
+/*
+ * Create a new thread that lives on CPU for good.
+ */
+int
+thread_fork_bound(const char *name,
+		  struct proc *proc,
+		  struct cpu *cpu,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, cpu, true,
+				  entrypoint, data1, data2);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -586,6 +865,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
 		thread_make_runnable(cur, true /*have lock*/);
+		/* Yields from the timer interrupt are preemptions. */
+		if (cur->t_in_interrupt) {
+			cur->t_involswitches++;
+		}
+		else {
+			cur->t_volswitches++;
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -604,6 +890,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 */
 		threadlist_addtail(&wc->wc_threads, cur);
 		wchan_unlock(wc);
+		cur->t_volswitches++;
 		break;
 	    case S_ZOMBIE:
 		cur->t_wchan_name = "ZOMBIE";
@@ -632,7 +919,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = thread_remhighest(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
@@ -640,6 +927,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	_cpustat_inc(CPUSTAT_CTXSWITCH);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -808,6 +1096,19 @@ thread_exit(void)
 	panic("The zombie walks!\n");
 }
 
+/*
+ * Change the current thread's priority. The new priority is used from
+ * the next context switch on (at the latest, the next hardclock).
+ */
+void
+thread_setpriority(int pri)
+{
+	KASSERT(pri >= THREAD_PRI_MIN && pri <= THREAD_PRI_MAX);
+
+	curthread->t_basepri = pri;
+	lock_update_priority();
+}
+
 /*
  * Yield the cpu to another process, but stay runnable.
  */
@@ -819,6 +1120,68 @@ thread_yield(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Copy a string that may change or go away under us, stopping at
+ * LEN-1 characters no matter what. Used only by thread_snapshot.
+ */
+static
+void
+thread_copyname(char *dest, const char *src, size_t len)
+{
+	size_t i;
+
+	if (src == NULL) {
+		src = "";
+	}
+	for (i=0; i<len-1 && src[i] != 0; i++) {
+		dest[i] = src[i];
+	}
+	dest[i] = 0;
+}
+
+/*
+ * Snapshot all threads for the thread inspector.
+ *
+ * Only allthreads_lock is held. That keeps the threads themselves
+ * (and their names) from being destroyed under us, but not their
+ * state, wait channel, or process, which can change at any moment on
+ * other cpus. For a diagnostic tool that is fine, but it means the
+ * wchan and proc names are copied with thread_copyname: they might be
+ * freed while we look at them, and we'd rather show garbage than
+ * trust a terminator.
+ */
+unsigned
+thread_snapshot(struct threadinfo *info, unsigned max)
+{
+	struct thread *t;
+	struct proc *p;
+	unsigned n, total;
+
+	spinlock_acquire(&allthreads_lock);
+	total = allthreads_count;
+	for (t = allthreads, n = 0; t != NULL && n < max; t = t->t_allnext) {
+		thread_copyname(info[n].ti_name, t->t_name,
+				sizeof(info[n].ti_name));
+		thread_copyname(info[n].ti_wchan, t->t_wchan_name,
+				sizeof(info[n].ti_wchan));
+		p = t->t_proc;
+		thread_copyname(info[n].ti_proc,
+				p != NULL ? p->p_name : NULL,
+				sizeof(info[n].ti_proc));
+		info[n].ti_state = t->t_state;
+		info[n].ti_cpu = t->t_cpu != NULL ? t->t_cpu->c_number : 0;
+		info[n].ti_runticks = t->t_runticks;
+		info[n].ti_volswitches = t->t_volswitches;
+		info[n].ti_involswitches = t->t_involswitches;
+		n++;
+	}
+	spinlock_release(&allthreads_lock);
+
+	return total;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Scheduler.
  *
@@ -917,7 +1280,8 @@ thread_consider_migration(void)
 			 * skip it. Then it goes back on our own run
 			 * queue below.
 			 */
-			if (t == curthread) {
+			if (t == curthread || t->t_bound) {
+				/* Bound threads stay put too. */
 				threadlist_addtail(&victims, t);
 				to_send--;
 				continue;
@@ -1036,9 +1400,9 @@ wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
 
-	/* Lock the channel and grab a thread from it */
+	/* Lock the channel and grab the most important thread from it */
 	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
+	target = thread_remhighest(&wc->wc_threads);
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1168,6 +1532,8 @@ interprocessor_interrupt(void)
 	uint32_t bits;
 	int i;
 
+	_cpustat_inc(CPUSTAT_IPI);
+
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
 
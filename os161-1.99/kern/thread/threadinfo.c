@@ -0,0 +1,252 @@
+/*
+ * Thread inspector.
+ *
+ * Formats the snapshots taken by thread_snapshot() for the "ps" menu
+ * command and for the "threads:" device. See <threadinfo.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <cpu.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <threadinfo.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Room for threads created between counting and copying. */
+#define THREADINFO_SLACK 8
+
+/* Room for each line of the report. */
+#define THREADINFO_HDRLEN  160
+#define THREADINFO_CPULEN  48
+#define THREADINFO_LINELEN 128
+
+static const char *const threadinfo_states[] = {
+	"run",		/* S_RUN */
+	"ready",	/* S_READY */
+	"sleep",	/* S_SLEEP */
+	"zombie",	/* S_ZOMBIE */
+};
+
+/*
+ * Build the report.
+ */
+int
+threadinfo_report(char **ret, size_t *retlen)
+{
+	struct threadinfo *info;
+	struct cpu *c;
+	unsigned i, num, max, numcpus;
+	char *buf;
+	size_t buflen, pos;
+
+	/*
+	 * Size the snapshot from the current thread count, plus some
+	 * slack. If even more threads appear before we copy, the
+	 * report just leaves them out and says so.
+	 */
+	max = thread_snapshot(NULL, 0) + THREADINFO_SLACK;
+	info = kmalloc(max * sizeof(*info));
+	if (info == NULL) {
+		return ENOMEM;
+	}
+	num = thread_snapshot(info, max);
+
+	numcpus = cpu_count();
+	buflen = THREADINFO_HDRLEN + numcpus * THREADINFO_CPULEN
+		+ max * THREADINFO_LINELEN;
+	buf = kmalloc(buflen);
+	if (buf == NULL) {
+		kfree(info);
+		return ENOMEM;
+	}
+
+	pos = 0;
+	pos += snprintf(buf+pos, buflen-pos, "%-6s %6s %6s\n",
+			"CPU", "RUNQ", "IDLE");
+	for (i=0; i<numcpus; i++) {
+		/* Unlocked reads: only a snapshot. */
+		c = cpu_get(i);
+		pos += snprintf(buf+pos, buflen-pos, "cpu%-3u %6u %6s\n",
+				c->c_number, c->c_runqueue.tl_count,
+				c->c_isidle ? "yes" : "no");
+	}
+
+	pos += snprintf(buf+pos, buflen-pos,
+			"%-20s %-6s %-12s %3s %9s %7s %7s %s\n",
+			"THREAD", "STATE", "WCHAN", "CPU", "TIME(ms)",
+			"VOLSW", "INVSW", "PROC");
+	for (i=0; i<num && i<max; i++) {
+		KASSERT(info[i].ti_state <= S_ZOMBIE);
+		pos += snprintf(buf+pos, buflen-pos,
+				"%-20s %-6s %-12s %3u %9u %7u %7u %s\n",
+				info[i].ti_name,
+				threadinfo_states[info[i].ti_state],
+				info[i].ti_wchan[0] ? info[i].ti_wchan : "-",
+				info[i].ti_cpu,
+				info[i].ti_runticks * (1000 / HZ),
+				info[i].ti_volswitches,
+				info[i].ti_involswitches,
+				info[i].ti_proc[0] ? info[i].ti_proc : "-");
+	}
+	if (num > max) {
+		pos += snprintf(buf+pos, buflen-pos,
+				"(%u more threads not shown)\n", num - max);
+	}
+	KASSERT(pos < buflen);
+
+	kfree(info);
+	*ret = buf;
+	*retlen = pos;
+	return 0;
+}
+
+/*
+ * Print the report on the console.
+ */
+void
+threadinfo_print(void)
+{
+	char *text;
+	size_t len;
+	int result;
+
+	result = threadinfo_report(&text, &len);
+	if (result) {
+		kprintf("threadinfo: %s\n", strerror(result));
+		return;
+	}
+	kprintf("%s", text);
+	kfree(text);
+}
+
+////////////////////////////////////////////////////////////
+//
+// The "threads:" device.
+//
+// Reading at offset 0 takes a fresh snapshot; reads at later offsets
+// continue from the same snapshot, so reading the device through in
+// chunks (e.g. with the "pf" menu command) gives a coherent report.
+
+struct threadsdev {
+	struct semaphore *td_sem;	/* mutual exclusion */
+	char *td_text;			/* current report, or NULL */
+	size_t td_len;			/* length of td_text */
+};
+
+/* For open() */
+static
+int
+threadsdev_open(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+/* For close() */
+static
+int
+threadsdev_close(struct device *dev)
+{
+	(void)dev;
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+threadsdev_io(struct device *dev, struct uio *uio)
+{
+	struct threadsdev *td = dev->d_data;
+	size_t len;
+	int result;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		return EINVAL;
+	}
+
+	P(td->td_sem);
+
+	if (uio->uio_offset == 0 || td->td_text == NULL) {
+		if (td->td_text != NULL) {
+			kfree(td->td_text);
+			td->td_text = NULL;
+		}
+		result = threadinfo_report(&td->td_text, &td->td_len);
+		if (result) {
+			V(td->td_sem);
+			return result;
+		}
+	}
+
+	result = 0;
+	if (uio->uio_offset >= 0 && (size_t)uio->uio_offset < td->td_len) {
+		len = td->td_len - uio->uio_offset;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		result = uiomove(td->td_text + uio->uio_offset, len, uio);
+	}
+
+	V(td->td_sem);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+threadsdev_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+/*
+ * Function to create and attach threads:
+ */
+void
+devthreads_create(void)
+{
+	int result;
+	struct device *dev;
+	struct threadsdev *td;
+
+	dev = kmalloc(sizeof(*dev));
+	td = kmalloc(sizeof(*td));
+	if (dev == NULL || td == NULL) {
+		panic("Could not add threads device: out of memory\n");
+	}
+
+	td->td_sem = sem_create("threads:", 1);
+	if (td->td_sem == NULL) {
+		panic("Could not add threads device: out of memory\n");
+	}
+	td->td_text = NULL;
+	td->td_len = 0;
+
+	dev->d_open = threadsdev_open;
+	dev->d_close = threadsdev_close;
+	dev->d_io = threadsdev_io;
+	dev->d_ioctl = threadsdev_ioctl;
+
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = td;
+
+	result = vfs_adddev("threads", dev, 0);
+	if (result) {
+		panic("Could not add threads device: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,360 @@
+/*
+ * Kernel work queues.
+ *
+ * See <workqueue.h> for the interface.
+ *
+ * Each cpu has one struct workqueue, holding a FIFO of work that is
+ * ready to run and a list of delayed work sorted by expiry time. Both
+ * are protected by wq_lock. Workers sleep on wq_wchan when there is
+ * nothing to do.
+ *
+ * Work is always queued on the current cpu, and the workers are bound
+ * to their cpu, so work runs where it was submitted. Delayed work is
+ * timed against that cpu's c_hardclocks and released by
+ * workqueue_tick, which hardclock calls on each cpu.
+ *
+ * Lock ordering: wq_lock, then the wchan lock, then the run queue
+ * lock (the same as for semaphores).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+
+/* Number of worker threads per cpu. */
+#define WORKQUEUE_NWORKERS 2
+
+struct workqueue {
+	struct spinlock wq_lock;
+	struct wchan *wq_wchan;		/* workers wait here */
+	struct work *wq_head;		/* ready work, FIFO */
+	struct work *wq_tail;
+	struct work *wq_delayed;	/* delayed work, by w_expire */
+};
+
+/*
+ * Set up a work item.
+ */
+void
+work_init(struct work *w, void (*func)(void *), void *arg)
+{
+	w->w_func = func;
+	w->w_arg = arg;
+	w->w_next = NULL;
+	w->w_expire = 0;
+	spinlock_data_set(&w->w_pending, 0);
+	w->w_wq = NULL;
+	w->w_allocated = false;
+}
+
+/*
+ * Claim W for queueing. Returns false if it's already pending.
+ *
+ * The pending flag is set with test-and-set rather than under a queue
+ * lock because the item might be pending on some other cpu's queue.
+ * spinlock_data_testandset can fail spuriously (it reports "already
+ * set" if the store-conditional loses), so check the real value
+ * before giving up.
+ */
+static
+bool
+work_claim(struct work *w)
+{
+	while (spinlock_data_testandset(&w->w_pending) != 0) {
+		if (spinlock_data_get(&w->w_pending) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Put W on the ready list and wake a worker. wq_lock must be held.
+ */
+static
+void
+workqueue_ready(struct workqueue *wq, struct work *w)
+{
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+
+	w->w_next = NULL;
+	if (wq->wq_tail == NULL) {
+		wq->wq_head = w;
+	}
+	else {
+		wq->wq_tail->w_next = w;
+	}
+	wq->wq_tail = w;
+	wchan_wakeone(wq->wq_wchan);
+}
+
+/*
+ * Common code for queueing. Runs with interrupts off so curcpu
+ * can't change under us.
+ */
+static
+int
+workqueue_add(struct work *w, bool delayed, unsigned ticks)
+{
+	struct workqueue *wq;
+	struct work **pw;
+	int spl;
+
+	spl = splhigh();
+
+	wq = curcpu->c_workqueue;
+	if (wq == NULL) {
+		splx(spl);
+		return ENXIO;
+	}
+
+	if (!work_claim(w)) {
+		splx(spl);
+		return EBUSY;
+	}
+
+	spinlock_acquire(&wq->wq_lock);
+	w->w_wq = wq;
+	if (!delayed || ticks == 0) {
+		workqueue_ready(wq, w);
+	}
+	else {
+		/* Insert in order of expiry; wraparound-safe comparison. */
+		w->w_expire = curcpu->c_hardclocks + ticks;
+		for (pw = &wq->wq_delayed; *pw != NULL; pw = &(*pw)->w_next) {
+			if ((int)((*pw)->w_expire - w->w_expire) > 0) {
+				break;
+			}
+		}
+		w->w_next = *pw;
+		*pw = w;
+	}
+	spinlock_release(&wq->wq_lock);
+
+	splx(spl);
+	return 0;
+}
+
+int
+workqueue_queue(struct work *w)
+{
+	return workqueue_add(w, false, 0);
+}
+
+int
+workqueue_queue_delayed(struct work *w, unsigned ticks)
+{
+	return workqueue_add(w, true, ticks);
+}
+
+/*
+ * Take W off whichever queue it's pending on. Only embedded items
+ * can be cancelled; a one-shot item's owner doesn't have a pointer
+ * to it.
+ */
+int
+workqueue_cancel(struct work *w)
+{
+	struct workqueue *wq;
+	struct work **pw, *prev;
+	bool found;
+
+	KASSERT(!w->w_allocated);
+
+	if (spinlock_data_get(&w->w_pending) == 0) {
+		return ENOENT;
+	}
+	wq = w->w_wq;
+	KASSERT(wq != NULL);
+
+	found = false;
+	spinlock_acquire(&wq->wq_lock);
+	for (pw = &wq->wq_delayed; *pw != NULL; pw = &(*pw)->w_next) {
+		if (*pw == w) {
+			*pw = w->w_next;
+			found = true;
+			break;
+		}
+	}
+	prev = NULL;
+	for (pw = &wq->wq_head; !found && *pw != NULL; pw = &(*pw)->w_next) {
+		if (*pw == w) {
+			*pw = w->w_next;
+			if (wq->wq_tail == w) {
+				wq->wq_tail = prev;
+			}
+			found = true;
+			break;
+		}
+		prev = *pw;
+	}
+	if (found) {
+		/* As in workqueue_worker. */
+		spinlock_data_set(&w->w_pending, 0);
+	}
+	spinlock_release(&wq->wq_lock);
+
+	/* If it wasn't on the queue, a worker has it. */
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Allocate a one-shot work item and queue it.
+ */
+static
+int
+workqueue_submit_common(void (*func)(void *), void *arg,
+			bool delayed, unsigned ticks)
+{
+	struct work *w;
+	int result;
+
+	w = kmalloc(sizeof(*w));
+	if (w == NULL) {
+		return ENOMEM;
+	}
+	work_init(w, func, arg);
+	w->w_allocated = true;
+
+	result = workqueue_add(w, delayed, ticks);
+	if (result) {
+		kfree(w);
+		return result;
+	}
+	return 0;
+}
+
+int
+workqueue_submit(void (*func)(void *), void *arg)
+{
+	return workqueue_submit_common(func, arg, false, 0);
+}
+
+int
+workqueue_submit_delayed(void (*func)(void *), void *arg, unsigned ticks)
+{
+	return workqueue_submit_common(func, arg, true, ticks);
+}
+
+/*
+ * Move delayed work whose time has come to the ready list.
+ * Called from hardclock, so interrupts are already off.
+ */
+void
+workqueue_tick(void)
+{
+	struct workqueue *wq;
+	struct work *w;
+	unsigned now;
+
+	wq = curcpu->c_workqueue;
+	if (wq == NULL || wq->wq_delayed == NULL) {
+		/* Unlocked peek; we'll see it next tick if we lose. */
+		return;
+	}
+
+	now = curcpu->c_hardclocks;
+	spinlock_acquire(&wq->wq_lock);
+	while ((w = wq->wq_delayed) != NULL &&
+	       (int)(now - w->w_expire) >= 0) {
+		wq->wq_delayed = w->w_next;
+		workqueue_ready(wq, w);
+	}
+	spinlock_release(&wq->wq_lock);
+}
+
+/*
+ * Worker thread.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long data2)
+{
+	struct workqueue *wq = data1;
+	struct work *w;
+	void (*func)(void *);
+	void *arg;
+
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&wq->wq_lock);
+		while ((w = wq->wq_head) == NULL) {
+			/* Same handoff as in P(). */
+			wchan_lock(wq->wq_wchan);
+			spinlock_release(&wq->wq_lock);
+			wchan_sleep(wq->wq_wchan);
+			spinlock_acquire(&wq->wq_lock);
+		}
+		wq->wq_head = w->w_next;
+		if (wq->wq_head == NULL) {
+			wq->wq_tail = NULL;
+		}
+		spinlock_release(&wq->wq_lock);
+
+		/*
+		 * Copy out what we need and release the item before
+		 * calling it, so the function can requeue (or free)
+		 * its own work item.
+		 */
+		func = w->w_func;
+		arg = w->w_arg;
+		if (w->w_allocated) {
+			kfree(w);
+		}
+		else {
+			spinlock_data_set(&w->w_pending, 0);
+		}
+
+		func(arg);
+	}
+}
+
+/*
+ * Create a queue and its workers for each cpu.
+ */
+void
+workqueue_bootstrap(void)
+{
+	struct workqueue *wq;
+	struct cpu *c;
+	char name[32];
+	unsigned i, j;
+	int result;
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+
+		wq = kmalloc(sizeof(*wq));
+		if (wq == NULL) {
+			panic("workqueue_bootstrap: Out of memory\n");
+		}
+		spinlock_init(&wq->wq_lock);
+		wq->wq_wchan = wchan_create("workqueue");
+		if (wq->wq_wchan == NULL) {
+			panic("workqueue_bootstrap: Out of memory\n");
+		}
+		wq->wq_head = wq->wq_tail = NULL;
+		wq->wq_delayed = NULL;
+
+		for (j=0; j<WORKQUEUE_NWORKERS; j++) {
+			snprintf(name, sizeof(name), "worker%u.%u", i, j);
+			result = thread_fork_bound(name, NULL, c,
+						   workqueue_worker, wq, j);
+			if (result) {
+				panic("workqueue_bootstrap: thread_fork: %s\n",
+				      strerror(result));
+			}
+		}
+
+		/* Publish it; from now on work may be queued here. */
+		c->c_workqueue = wq;
+	}
+}
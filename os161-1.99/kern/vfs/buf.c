@@ -0,0 +1,1059 @@
+/*
+ * Buffer cache.
+ *
+ * See <buf.h> for the interface.
+ *
+ * Buffers are found through a hash table keyed on (device, block).
+ * Buffers that nobody has pinned are also on a doubly-linked LRU
+ * list, least recently released at the head; that is where victims
+ * come from. Buffers that have been dropped (and so belong to no
+ * block) are put at the head so they get reused first.
+ *
+ * Everything is protected by buf_lock, which is a sleep lock so it
+ * can be held across kmalloc. It is not held across disk I/O: a
+ * buffer undergoing I/O is pinned and marked busy, and anyone else
+ * who wants it waits on buf_cv until it isn't. buf_cv is also where
+ * buffer_get waits when every buffer is pinned.
+ *
+ * Runs of consecutive blocks move to and from the device in one
+ * transfer where possible: buffer_readrun reads all the missing
+ * blocks of a run at once, and writing back a dirty buffer takes its
+ * dirty neighbours along with it.
+ *
+ * The flusher thread writes dirty buffers back in the background. It
+ * wakes up every BUF_FLUSHTICKS, and writes back whatever has been
+ * dirty for BUF_DIRTYAGE seconds or more; or everything, if more than
+ * BUF_DIRTYMAX bytes are dirty, in which case buffer_mark_dirty also
+ * wakes it early. It leaves pinned buffers alone, since whoever has
+ * them may be in the middle of changing them.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+#include <device.h>
+#include <buf.h>
+
+/* Number of hash chains. */
+#define BUF_HASHSIZE	64
+
+/* How many times to retry an I/O that fails with EIO. */
+#define BUF_MAXTRIES	10
+
+/*
+ * Most bytes one run may pin at once. Kept well below BUF_MAXBYTES
+ * so a big transfer can't crowd everyone else out of the cache.
+ */
+#define BUF_MAXRUNBYTES	(BUF_MAXBYTES / 4)
+
+/* How often the flusher runs, in hardclocks. */
+#define BUF_FLUSHTICKS	HZ
+
+struct buf {
+	struct device *b_dev;		/* device, or NULL if unused */
+	uint32_t b_block;		/* block number on b_dev */
+	size_t b_size;			/* size of b_data */
+	void *b_data;			/* the cached block */
+
+	unsigned b_pincount;		/* number of users */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data needs writing back */
+	bool b_busy;			/* I/O in progress */
+	bool b_held;			/* not to be written back yet */
+	struct thread *b_filler;	/* buffer_get caller filling it in */
+	time_t b_dirtysince;		/* when it became dirty, in seconds */
+
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list (unpinned only) */
+	struct buf *b_lrunext;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *buf_lruhead;
+static struct buf *buf_lrutail;
+
+/* Space allocated for b_data so far, and how much of it is dirty. */
+static size_t buf_bytes;
+static size_t buf_dirtybytes;
+
+/* The flusher waits on buf_flushsem; buf_flushtimer wakes it. */
+static struct semaphore *buf_flushsem;
+static struct work buf_flushtimer;
+static bool buf_flushwoken;	/* buf_flushsem already upped */
+
+/* Statistics. */
+static unsigned buf_hits, buf_misses, buf_evictions, buf_writes;
+static unsigned buf_flushes;
+
+static void buf_flushwake(void);
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+buf_hashfn(struct device *dev, uint32_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) % BUF_HASHSIZE;
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	for (b = buf_hash[buf_hashfn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashadd(struct buf *b)
+{
+	unsigned h;
+
+	h = buf_hashfn(b->b_dev, b->b_block);
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **pb;
+
+	for (pb = &buf_hash[buf_hashfn(b->b_dev, b->b_block)]; *pb != b;
+	     pb = &(*pb)->b_hashnext) {
+		KASSERT(*pb != NULL);
+	}
+	*pb = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buf_lruhead == b);
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buf_lrutail == b);
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buf_lruaddtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+static
+void
+buf_lruaddhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+/*
+ * Set or clear b_dirty, keeping count of dirty bytes.
+ */
+static
+void
+buf_setdirty(struct buf *b, bool dirty)
+{
+	if (b->b_dirty == dirty) {
+		return;
+	}
+	b->b_dirty = dirty;
+	if (dirty) {
+		buf_dirtybytes += b->b_size;
+	}
+	else {
+		KASSERT(buf_dirtybytes >= b->b_size);
+		buf_dirtybytes -= b->b_size;
+	}
+}
+
+static
+void
+buf_pin(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	if (b->b_pincount++ == 0) {
+		buf_lruremove(b);
+	}
+}
+
+static
+void
+buf_unpin(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_pincount > 0);
+
+	if (--b->b_pincount == 0) {
+		buf_lruaddtail(b);
+		/* Someone may be waiting for a victim. */
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+/*
+ * Wait until nobody is doing I/O on B. B must be pinned.
+ */
+static
+void
+buf_waitidle(struct buf *b)
+{
+	KASSERT(b->b_pincount > 0);
+
+	while (b->b_busy) {
+		cv_wait(buf_cv, buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Read or write the N buffers in BUFS, which hold consecutive blocks
+ * of the same device, as a single transfer. Retries a few times on
+ * EIO, as disks sometimes have transient errors. Called without
+ * buf_lock; the buffers must be pinned and marked busy.
+ */
+static
+int
+buf_iorun(struct buf **bufs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUF_MAXRUN];
+	struct uio ku;
+	struct buf *b = bufs[0];
+	unsigned i, tries;
+	int result;
+
+	KASSERT(n > 0 && n <= BUF_MAXRUN);
+
+	for (tries = 0; ; tries++) {
+		for (i=0; i<n; i++) {
+			KASSERT(bufs[i]->b_busy);
+			KASSERT(bufs[i]->b_dev == b->b_dev);
+			KASSERT(bufs[i]->b_block == b->b_block + i);
+			KASSERT(bufs[i]->b_size == b->b_size);
+			iov[i].iov_kbase = bufs[i]->b_data;
+			iov[i].iov_len = b->b_size;
+		}
+		ku.uio_iov = iov;
+		ku.uio_iovcnt = n;
+		ku.uio_offset = (off_t)b->b_block * b->b_size;
+		ku.uio_resid = n * b->b_size;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = rw;
+		ku.uio_space = NULL;
+
+		result = b->b_dev->d_io(b->b_dev, &ku);
+		if (result != EIO || tries >= BUF_MAXTRIES) {
+			break;
+		}
+		if (tries == 0) {
+			kprintf("buf: blocks %u-%u I/O error, retrying\n",
+				b->b_block, b->b_block + n - 1);
+		}
+	}
+	if (result == EIO) {
+		kprintf("buf: blocks %u-%u I/O error, giving up after "
+			"%u retries\n", b->b_block, b->b_block + n - 1, tries);
+	}
+	else if (result == 0 && ku.uio_resid > 0) {
+		/* Block past the end of the device */
+		result = EIO;
+	}
+	return result;
+}
+
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	return buf_iorun(&b, 1, rw);
+}
+
+/*
+ * Check if the block after (or before) B is cached, dirty, and not
+ * in use, so it can go to disk in the same write. Pinned neighbours
+ * are left alone: whoever has one may be halfway through changing it
+ * (or, if it's held, has asked for it to stay put).
+ */
+static
+struct buf *
+buf_writeneighbour(struct buf *b, bool after)
+{
+	struct buf *nb;
+
+	if (!after && b->b_block == 0) {
+		return NULL;
+	}
+	nb = buf_lookup(b->b_dev, after ? b->b_block + 1 : b->b_block - 1);
+	if (nb == NULL || nb->b_size != b->b_size || nb->b_busy ||
+	    nb->b_pincount > 0 || !nb->b_valid || !nb->b_dirty) {
+		return NULL;
+	}
+	return nb;
+}
+
+/*
+ * Write B back to disk, along with any dirty buffers on either side
+ * of it, as one transfer. Called with buf_lock held; B must be
+ * pinned, idle, and dirty. Drops buf_lock during the I/O.
+ */
+static
+int
+buf_write(struct buf *b)
+{
+	struct buf *run[BUF_MAXRUN];
+	struct buf *nb;
+	unsigned i, n, max;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_pincount > 0);
+	KASSERT(!b->b_busy);
+	KASSERT(!b->b_held);
+	KASSERT(b->b_valid && b->b_dirty);
+
+	max = BUF_MAXRUNBYTES / b->b_size;
+	if (max > BUF_MAXRUN) {
+		max = BUF_MAXRUN;
+	}
+	if (max == 0) {
+		max = 1;
+	}
+
+	/*
+	 * Collect the run outward from B, so B is always in it even
+	 * though it's pinned (by our caller): first the blocks before
+	 * it, nearest first, which then get put in order, and then the
+	 * ones after it.
+	 */
+	run[0] = b;
+	for (n = 1, nb = b; n < max; n++) {
+		nb = buf_writeneighbour(nb, false);
+		if (nb == NULL) {
+			break;
+		}
+		run[n] = nb;
+	}
+	for (i=0; i < n/2; i++) {
+		nb = run[i];
+		run[i] = run[n-1-i];
+		run[n-1-i] = nb;
+	}
+	for (nb = b; n < max; n++) {
+		nb = buf_writeneighbour(nb, true);
+		if (nb == NULL) {
+			break;
+		}
+		run[n] = nb;
+	}
+
+	for (i=0; i<n; i++) {
+		if (run[i] != b) {
+			buf_pin(run[i]);
+		}
+		run[i]->b_busy = true;
+		/*
+		 * Clear first, so a change made during the write
+		 * re-dirties it.
+		 */
+		buf_setdirty(run[i], false);
+	}
+	lock_release(buf_lock);
+
+	result = buf_iorun(run, n, UIO_WRITE);
+
+	lock_acquire(buf_lock);
+	for (i=0; i<n; i++) {
+		run[i]->b_busy = false;
+		if (result) {
+			/* Still as old as it was. */
+			buf_setdirty(run[i], true);
+		}
+		else {
+			buf_writes++;
+		}
+		if (run[i] != b) {
+			buf_unpin(run[i]);
+		}
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting buffers
+
+/*
+ * Find a buffer of SIZE bytes to load a new block into. On success
+ * returns 0 with a buffer that is on no list. If buf_lock had to be
+ * released along the way, or a buffer of the wrong size was freed to
+ * make room, returns EAGAIN and the caller should look the block up
+ * again, since someone else may have loaded it. If
+ * every buffer is pinned, waits for one to come back if WAIT is set
+ * and fails with EBUSY otherwise.
+ */
+static
+int
+buf_obtain(size_t size, bool wait, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	/* If we're still under the limit, make a new one. */
+	if (buf_bytes + size <= BUF_MAXBYTES) {
+		b = kmalloc(sizeof(*b));
+		if (b == NULL) {
+			return ENOMEM;
+		}
+		b->b_data = kmalloc(size);
+		if (b->b_data == NULL) {
+			kfree(b);
+			return ENOMEM;
+		}
+		b->b_size = size;
+		buf_bytes += size;
+		b->b_dev = NULL;
+		b->b_hashnext = b->b_lruprev = b->b_lrunext = NULL;
+		*ret = b;
+		return 0;
+	}
+
+	b = buf_lruhead;
+	if (b == NULL) {
+		if (!wait) {
+			return EBUSY;
+		}
+		/* Everything is pinned; wait for something to come back. */
+		cv_wait(buf_cv, buf_lock);
+		return EAGAIN;
+	}
+
+	if (b->b_dirty) {
+		/* Clean it and start over. */
+		buf_pin(b);
+		result = buf_write(b);
+		buf_unpin(b);
+		return result ? result : EAGAIN;
+	}
+
+	/* Take it. */
+	buf_lruremove(b);
+	if (b->b_dev != NULL) {
+		buf_hashremove(b);
+		b->b_dev = NULL;
+		buf_evictions++;
+	}
+	if (b->b_size != size) {
+		/*
+		 * Wrong size. Free it rather than resizing it in
+		 * place, which could take the cache over
+		 * BUF_MAXBYTES. The next try makes a new buffer if
+		 * there's room now, and evicts another one if not.
+		 */
+		buf_bytes -= b->b_size;
+		kfree(b->b_data);
+		kfree(b);
+		return EAGAIN;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Find or create the buffer for (DEV, BLOCK) and pin it. buf_lock
+ * must be held. WAIT is as for buf_obtain.
+ */
+static
+int
+buf_find(struct device *dev, uint32_t block, size_t size, bool wait,
+	 struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	while (1) {
+		b = buf_lookup(dev, block);
+		if (b != NULL) {
+			KASSERT(b->b_size == size);
+			buf_pin(b);
+			buf_waitidle(b);
+			*ret = b;
+			return 0;
+		}
+
+		result = buf_obtain(size, wait, &b);
+		if (result == 0) {
+			break;
+		}
+		if (result != EAGAIN) {
+			return result;
+		}
+	}
+
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_held = false;
+	b->b_filler = NULL;
+	b->b_pincount = 1;
+	buf_hashadd(b);
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, uint32_t block, size_t size, struct buf **ret)
+{
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_find(dev, block, size, true, ret);
+	if (result == 0 && !(*ret)->b_valid) {
+		/* Until it's marked valid, buffer_readrun keeps off. */
+		(*ret)->b_filler = curthread;
+	}
+	lock_release(buf_lock);
+	return result;
+}
+
+int
+buffer_read(struct device *dev, uint32_t block, size_t size, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_find(dev, block, size, true, &b);
+	if (result) {
+		lock_release(buf_lock);
+		return result;
+	}
+
+	if (b->b_valid) {
+		buf_hits++;
+	}
+	else {
+		buf_misses++;
+		b->b_busy = true;
+		lock_release(buf_lock);
+
+		result = buf_io(b, UIO_READ);
+
+		lock_acquire(buf_lock);
+		b->b_busy = false;
+		if (result == 0) {
+			b->b_valid = true;
+		}
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			buf_unpin(b);
+			lock_release(buf_lock);
+			return result;
+		}
+	}
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_readrun(struct device *dev, uint32_t block, size_t size,
+	       unsigned *nblocks, struct buf **bufs)
+{
+	struct buf *b;
+	unsigned i, j, n, max;
+	int result;
+
+	KASSERT(*nblocks > 0 && *nblocks <= BUF_MAXRUN);
+
+	max = BUF_MAXRUNBYTES / size;
+	if (max > *nblocks) {
+		max = *nblocks;
+	}
+	if (max == 0) {
+		max = 1;
+	}
+
+	lock_acquire(buf_lock);
+
+	/*
+	 * Pin the whole run. Only the first block is worth waiting
+	 * for; if the rest would mean waiting for someone else to give
+	 * buffers back (or running out of memory), settle for a
+	 * shorter run. Otherwise two threads each holding part of a
+	 * run could wait for each other forever.
+	 */
+	result = buf_find(dev, block, size, true, &bufs[0]);
+	if (result) {
+		lock_release(buf_lock);
+		return result;
+	}
+	for (n = 1; n < max; n++) {
+		if (buf_find(dev, block + n, size, false, &bufs[n])) {
+			break;
+		}
+	}
+
+	/*
+	 * Load each stretch of missing blocks with a single transfer.
+	 * A block someone got with buffer_get and hasn't marked valid
+	 * yet is being filled in with new contents (prefetch doesn't
+	 * hold the file's lock), so reading it would clobber them;
+	 * wait for them instead.
+	 */
+	i = 0;
+	while (i < n) {
+		b = bufs[i];
+		KASSERT(b->b_filler != curthread);
+		while (b->b_busy || b->b_filler != NULL) {
+			cv_wait(buf_cv, buf_lock);
+		}
+		if (b->b_valid) {
+			buf_hits++;
+			i++;
+			continue;
+		}
+		for (j = i; j < n && !bufs[j]->b_valid && !bufs[j]->b_busy &&
+			     bufs[j]->b_filler == NULL; j++) {
+			bufs[j]->b_busy = true;
+			buf_misses++;
+		}
+		lock_release(buf_lock);
+
+		result = buf_iorun(&bufs[i], j - i, UIO_READ);
+
+		lock_acquire(buf_lock);
+		for (; i < j; i++) {
+			bufs[i]->b_busy = false;
+			if (result == 0) {
+				bufs[i]->b_valid = true;
+			}
+		}
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			for (i = 0; i < n; i++) {
+				buf_unpin(bufs[i]);
+			}
+			lock_release(buf_lock);
+			return result;
+		}
+	}
+
+	lock_release(buf_lock);
+	*nblocks = n;
+	return 0;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	if (b->b_filler == curthread) {
+		/* Given up on without being filled in. */
+		b->b_filler = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	buf_unpin(b);
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Using buffers
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_pincount > 0);
+	return b->b_data;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_pincount > 0);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_pincount > 0);
+
+	lock_acquire(buf_lock);
+	b->b_valid = true;
+	if (b->b_filler != NULL) {
+		b->b_filler = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	uint32_t nsecs;
+
+	KASSERT(b->b_pincount > 0);
+
+	lock_acquire(buf_lock);
+	KASSERT(b->b_valid);
+	if (!b->b_dirty) {
+		gettime(&b->b_dirtysince, &nsecs);
+		buf_setdirty(b, true);
+		if (buf_dirtybytes > BUF_DIRTYMAX) {
+			buf_flushwake();
+		}
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_hold(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_pincount > 0);
+	KASSERT(!b->b_held);
+	buf_pin(b);
+	b->b_held = true;
+	lock_release(buf_lock);
+}
+
+void
+buffer_unhold(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_held);
+	b->b_held = false;
+	buf_unpin(b);
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Writeback and invalidation
+
+void
+buffer_drop(struct device *dev, uint32_t block, size_t size)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+	b = buf_lookup(dev, block);
+	if (b != NULL) {
+		KASSERT(b->b_size == size);
+		KASSERT(!b->b_held);
+		buf_pin(b);
+		buf_waitidle(b);
+		b->b_valid = false;
+		buf_setdirty(b, false);
+		if (b->b_pincount == 1) {
+			/* Make it free, and first in line for reuse. */
+			b->b_pincount = 0;
+			buf_hashremove(b);
+			b->b_dev = NULL;
+			buf_lruaddhead(b);
+			cv_broadcast(buf_cv, buf_lock);
+		}
+		else {
+			buf_unpin(b);
+		}
+	}
+	lock_release(buf_lock);
+}
+
+int
+buffer_writeback(struct device *dev, uint32_t block, size_t size)
+{
+	struct buf *b;
+	int result = 0;
+
+	lock_acquire(buf_lock);
+	b = buf_lookup(dev, block);
+	if (b != NULL && b->b_dirty && !b->b_held) {
+		KASSERT(b->b_size == size);
+		buf_pin(b);
+		buf_waitidle(b);
+		if (b->b_dirty && !b->b_held) {
+			result = buf_write(b);
+		}
+		buf_unpin(b);
+	}
+	lock_release(buf_lock);
+	return result;
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i;
+	int result, ret = 0;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<BUF_HASHSIZE; i++) {
+		b = buf_hash[i];
+		while (b != NULL) {
+			if (b->b_dev != dev || !b->b_dirty || b->b_held) {
+				b = b->b_hashnext;
+				continue;
+			}
+			/*
+			 * Pinning B keeps it on this chain while the lock
+			 * is dropped, so b_hashnext is still good after.
+			 */
+			buf_pin(b);
+			buf_waitidle(b);
+			if (b->b_dirty && !b->b_held) {
+				result = buf_write(b);
+				if (result && ret == 0) {
+					ret = result;
+				}
+			}
+			next = b->b_hashnext;
+			buf_unpin(b);
+			b = next;
+		}
+	}
+	lock_release(buf_lock);
+	return ret;
+}
+
+void
+buffer_drop_device(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	for (i=0; i<BUF_HASHSIZE; i++) {
+		for (b = buf_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_dev != dev) {
+				continue;
+			}
+			KASSERT(b->b_pincount == 0);
+			KASSERT(!b->b_dirty && !b->b_held);
+			buf_hashremove(b);
+			buf_lruremove(b);
+			buf_bytes -= b->b_size;
+			kfree(b->b_data);
+			kfree(b);
+		}
+	}
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Background writeback
+
+/*
+ * Wake the flusher up, if it isn't already. buf_lock must be held.
+ */
+static
+void
+buf_flushwake(void)
+{
+	KASSERT(lock_do_i_hold(buf_lock));
+	if (!buf_flushwoken) {
+		buf_flushwoken = true;
+		V(buf_flushsem);
+	}
+}
+
+/*
+ * Timer for the flusher; runs from the work queue.
+ */
+static
+void
+buf_flushtick(void *arg)
+{
+	(void)arg;
+
+	lock_acquire(buf_lock);
+	buf_flushwake();
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back old dirty buffers, or all of them if there are too many.
+ */
+static
+void
+buf_flush(void)
+{
+	struct buf *b, *next;
+	time_t now;
+	uint32_t nsecs;
+	bool all;
+	unsigned i;
+
+	gettime(&now, &nsecs);
+
+	lock_acquire(buf_lock);
+	all = buf_dirtybytes > BUF_DIRTYMAX;
+	for (i=0; i<BUF_HASHSIZE; i++) {
+		b = buf_hash[i];
+		while (b != NULL) {
+			if (!b->b_dirty || b->b_pincount > 0 ||
+			    (!all && now - b->b_dirtysince < BUF_DIRTYAGE)) {
+				b = b->b_hashnext;
+				continue;
+			}
+			/* As in buffer_sync. */
+			buf_pin(b);
+			if (b->b_dirty && !b->b_held) {
+				/* If it fails it stays dirty; next time. */
+				(void)buf_write(b);
+				buf_flushes++;
+			}
+			next = b->b_hashnext;
+			buf_unpin(b);
+			b = next;
+		}
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * The flusher thread.
+ */
+static
+void
+buf_flusher(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		/* Set the next wakeup; this fails if it's already set. */
+		(void)workqueue_queue_delayed(&buf_flushtimer,
+					      BUF_FLUSHTICKS);
+		P(buf_flushsem);
+
+		lock_acquire(buf_lock);
+		buf_flushwoken = false;
+		lock_release(buf_lock);
+
+		buf_flush();
+	}
+}
+
+/*
+ * Start the flusher. Call after workqueue_bootstrap.
+ */
+void
+buffer_flusher_start(void)
+{
+	int result;
+
+	result = thread_fork("bufflush", NULL, buf_flusher, NULL, 0);
+	if (result) {
+		panic("buffer_flusher_start: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and statistics
+
+void
+buffer_printstats(void)
+{
+	lock_acquire(buf_lock);
+	kprintf("Buffer cache: %u bytes of %u in use\n",
+		(unsigned)buf_bytes, (unsigned)BUF_MAXBYTES);
+	kprintf("  %u hits, %u misses, %u evictions, %u writes\n",
+		buf_hits, buf_misses, buf_evictions, buf_writes);
+	kprintf("  %u bytes dirty, %u background writes\n",
+		(unsigned)buf_dirtybytes, buf_flushes);
+	lock_release(buf_lock);
+}
+
+void
+buffer_bootstrap(void)
+{
+	buf_lock = lock_create("buffer cache");
+	if (buf_lock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_cv = cv_create("buffer cache");
+	if (buf_cv == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	buf_flushsem = sem_create("buffer flush", 0);
+	if (buf_flushsem == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	work_init(&buf_flushtimer, buf_flushtick, NULL);
+	buf_flushwoken = false;
+	buf_bytes = 0;
+	buf_dirtybytes = 0;
+	buf_lruhead = buf_lrutail = NULL;
+}
@@ -0,0 +1,450 @@
+/*
+ * VFS name cache.
+ *
+ * Maps (directory vnode, name) to the vnode the name refers to, or to
+ * nothing: a negative entry remembers that the name doesn't exist,
+ * which is what most of the lookups along a search path find.
+ * vfs_lookup and vfs_lookparent look each path component up here
+ * before asking the filesystem. See <vfs.h> for the interface.
+ *
+ * Entries hold a reference to the directory and, if positive, to the
+ * target, so the pointers in them stay good. They come from a fixed
+ * pool of VFSCACHE_SIZE, and are found through a hash table keyed on
+ * (directory, name). Every entry is also on a doubly-linked LRU list,
+ * least recently used at the head; that is where new entries come
+ * from, so the cache never grows past the pool. Unused entries are
+ * kept at the head.
+ *
+ * A vnode a positive entry refers to stays referenced, so the
+ * filesystem can't count it as unused (SFS won't put it on its
+ * inactive list, let alone free it). To keep that from tying up most
+ * of the loaded vnodes, at most VFSCACHE_MAXPOSITIVE entries are
+ * positive; past that a new one replaces the least recently used
+ * positive entry instead of the entry at the head of the list.
+ *
+ * Everything that changes a directory goes through vfspath.c, which
+ * calls vfscache_purge for the name it changed afterwards. A lookup
+ * that misses notes vfscache_gen first, and its answer is only
+ * entered if nothing has been purged since; otherwise a lookup that
+ * raced with a change could put the old answer back. Entries under a
+ * directory that has been removed stay correct (there is nothing in
+ * it) and age out. Unmount purges the whole filesystem, since the
+ * references would otherwise keep it busy.
+ *
+ * Names longer than VFSCACHE_NAMELEN, "." and "..", and lookups on
+ * devices aren't cached.
+ *
+ * Everything is protected by vfscache_lock, which is a sleep lock
+ * because dropping a vnode reference can sleep. It is never held
+ * across a call into a filesystem: references to entries being
+ * thrown away are dropped after it is released.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries. */
+#define VFSCACHE_SIZE		128
+
+/* Most entries that hold a reference to their target. */
+#define VFSCACHE_MAXPOSITIVE	16
+
+/* Number of hash chains. */
+#define VFSCACHE_HASHSIZE	64
+
+/* Longest name that is cached. */
+#define VFSCACHE_NAMELEN	31
+
+struct vfscache_entry {
+	struct vnode *ce_dir;		/* directory, or NULL if unused */
+	struct vnode *ce_vn;		/* target, or NULL if negative */
+	char ce_name[VFSCACHE_NAMELEN+1];
+
+	struct vfscache_entry *ce_hashnext;	/* hash chain */
+	struct vfscache_entry *ce_lruprev;	/* LRU list */
+	struct vfscache_entry *ce_lrunext;
+};
+
+static struct lock *vfscache_lock;
+
+static struct vfscache_entry vfscache_entries[VFSCACHE_SIZE];
+static struct vfscache_entry *vfscache_hash[VFSCACHE_HASHSIZE];
+static struct vfscache_entry *vfscache_lruhead;
+static struct vfscache_entry *vfscache_lrutail;
+
+/* Number of entries with a target. */
+static unsigned vfscache_npositive;
+
+/* Bumped by every purge. */
+static unsigned vfscache_gen;
+
+/* Statistics. */
+static unsigned vfscache_hits, vfscache_neghits, vfscache_misses;
+static unsigned vfscache_evictions, vfscache_purges;
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+vfscache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % VFSCACHE_HASHSIZE;
+}
+
+static
+struct vfscache_entry *
+vfscache_find(struct vnode *dir, const char *name)
+{
+	struct vfscache_entry *ce;
+
+	KASSERT(lock_do_i_hold(vfscache_lock));
+
+	for (ce = vfscache_hash[vfscache_hashfn(dir, name)]; ce != NULL;
+	     ce = ce->ce_hashnext) {
+		if (ce->ce_dir == dir && !strcmp(ce->ce_name, name)) {
+			return ce;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+vfscache_hashremove(struct vfscache_entry *ce)
+{
+	struct vfscache_entry **pce;
+
+	for (pce = &vfscache_hash[vfscache_hashfn(ce->ce_dir, ce->ce_name)];
+	     *pce != ce; pce = &(*pce)->ce_hashnext) {
+		KASSERT(*pce != NULL);
+	}
+	*pce = ce->ce_hashnext;
+	ce->ce_hashnext = NULL;
+}
+
+static
+void
+vfscache_lruremove(struct vfscache_entry *ce)
+{
+	if (ce->ce_lruprev != NULL) {
+		ce->ce_lruprev->ce_lrunext = ce->ce_lrunext;
+	}
+	else {
+		KASSERT(vfscache_lruhead == ce);
+		vfscache_lruhead = ce->ce_lrunext;
+	}
+	if (ce->ce_lrunext != NULL) {
+		ce->ce_lrunext->ce_lruprev = ce->ce_lruprev;
+	}
+	else {
+		KASSERT(vfscache_lrutail == ce);
+		vfscache_lrutail = ce->ce_lruprev;
+	}
+	ce->ce_lruprev = ce->ce_lrunext = NULL;
+}
+
+static
+void
+vfscache_lruaddtail(struct vfscache_entry *ce)
+{
+	ce->ce_lrunext = NULL;
+	ce->ce_lruprev = vfscache_lrutail;
+	if (vfscache_lrutail != NULL) {
+		vfscache_lrutail->ce_lrunext = ce;
+	}
+	else {
+		vfscache_lruhead = ce;
+	}
+	vfscache_lrutail = ce;
+}
+
+static
+void
+vfscache_lruaddhead(struct vfscache_entry *ce)
+{
+	ce->ce_lruprev = NULL;
+	ce->ce_lrunext = vfscache_lruhead;
+	if (vfscache_lruhead != NULL) {
+		vfscache_lruhead->ce_lruprev = ce;
+	}
+	else {
+		vfscache_lrutail = ce;
+	}
+	vfscache_lruhead = ce;
+}
+
+/*
+ * Take entry CE out of use and move it to the head of the LRU list.
+ * Its references are handed back in *DIR and *VN, to be dropped once
+ * vfscache_lock has been released.
+ */
+static
+void
+vfscache_release(struct vfscache_entry *ce,
+		 struct vnode **dir, struct vnode **vn)
+{
+	KASSERT(lock_do_i_hold(vfscache_lock));
+	KASSERT(ce->ce_dir != NULL);
+
+	vfscache_hashremove(ce);
+	if (ce->ce_vn != NULL) {
+		KASSERT(vfscache_npositive > 0);
+		vfscache_npositive--;
+	}
+	*dir = ce->ce_dir;
+	*vn = ce->ce_vn;
+	ce->ce_dir = NULL;
+	ce->ce_vn = NULL;
+	ce->ce_name[0] = 0;
+
+	vfscache_lruremove(ce);
+	vfscache_lruaddhead(ce);
+}
+
+/*
+ * Drop the references handed back by vfscache_release.
+ */
+static
+void
+vfscache_drop(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Find the least recently used positive entry.
+ */
+static
+struct vfscache_entry *
+vfscache_oldestpositive(void)
+{
+	struct vfscache_entry *ce;
+
+	KASSERT(lock_do_i_hold(vfscache_lock));
+
+	for (ce = vfscache_lruhead; ce != NULL; ce = ce->ce_lrunext) {
+		if (ce->ce_vn != NULL) {
+			return ce;
+		}
+	}
+	panic("vfscache: %u positive entries but none found\n",
+	      vfscache_npositive);
+	return NULL;
+}
+
+static
+bool
+vfscache_cacheable(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL) {
+		return false;
+	}
+	if (strlen(name) > VFSCACHE_NAMELEN) {
+		return false;
+	}
+	return strcmp(name, ".") && strcmp(name, "..");
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+bool
+vfscache_lookup(struct vnode *dir, const char *name,
+		struct vnode **ret, unsigned *gen)
+{
+	struct vfscache_entry *ce;
+
+	lock_acquire(vfscache_lock);
+	*gen = vfscache_gen;
+	if (!vfscache_cacheable(dir, name)) {
+		lock_release(vfscache_lock);
+		return false;
+	}
+
+	ce = vfscache_find(dir, name);
+	if (ce == NULL) {
+		vfscache_misses++;
+		lock_release(vfscache_lock);
+		return false;
+	}
+
+	if (ce->ce_vn != NULL) {
+		VOP_INCREF(ce->ce_vn);
+		vfscache_hits++;
+	}
+	else {
+		vfscache_neghits++;
+	}
+	*ret = ce->ce_vn;
+
+	vfscache_lruremove(ce);
+	vfscache_lruaddtail(ce);
+	lock_release(vfscache_lock);
+	return true;
+}
+
+void
+vfscache_enter(struct vnode *dir, const char *name,
+	       struct vnode *vn, unsigned gen)
+{
+	struct vfscache_entry *ce;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	struct vnode *evictdir = NULL, *evictvn = NULL;
+	unsigned h;
+
+	lock_acquire(vfscache_lock);
+	if (gen != vfscache_gen || !vfscache_cacheable(dir, name)) {
+		lock_release(vfscache_lock);
+		return;
+	}
+
+	/*
+	 * Someone else may have got here first; throw their entry
+	 * out. That leaves it at the head of the list, where it gets
+	 * used again below unless we need a positive one to replace.
+	 */
+	ce = vfscache_find(dir, name);
+	if (ce != NULL) {
+		vfscache_release(ce, &olddir, &oldvn);
+	}
+
+	if (vn != NULL && vfscache_npositive >= VFSCACHE_MAXPOSITIVE) {
+		ce = vfscache_oldestpositive();
+	}
+	else {
+		ce = vfscache_lruhead;
+		KASSERT(ce != NULL);
+	}
+	if (ce->ce_dir != NULL) {
+		vfscache_evictions++;
+		vfscache_release(ce, &evictdir, &evictvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+		vfscache_npositive++;
+	}
+	ce->ce_dir = dir;
+	ce->ce_vn = vn;
+	strcpy(ce->ce_name, name);
+	h = vfscache_hashfn(dir, name);
+	ce->ce_hashnext = vfscache_hash[h];
+	vfscache_hash[h] = ce;
+	vfscache_lruremove(ce);
+	vfscache_lruaddtail(ce);
+	lock_release(vfscache_lock);
+
+	vfscache_drop(olddir, oldvn);
+	vfscache_drop(evictdir, evictvn);
+}
+
+void
+vfscache_purge(struct vnode *dir, const char *name)
+{
+	struct vfscache_entry *ce;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	lock_acquire(vfscache_lock);
+	vfscache_gen++;
+	if (vfscache_cacheable(dir, name)) {
+		ce = vfscache_find(dir, name);
+		if (ce != NULL) {
+			vfscache_purges++;
+			vfscache_release(ce, &olddir, &oldvn);
+		}
+	}
+	lock_release(vfscache_lock);
+
+	vfscache_drop(olddir, oldvn);
+}
+
+void
+vfscache_purgefs(struct fs *fs)
+{
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	lock_acquire(vfscache_lock);
+	vfscache_gen++;
+	i = 0;
+	while (i < VFSCACHE_SIZE) {
+		struct vfscache_entry *ce = &vfscache_entries[i];
+
+		if (ce->ce_dir == NULL || ce->ce_dir->vn_fs != fs) {
+			i++;
+			continue;
+		}
+		vfscache_purges++;
+		vfscache_release(ce, &olddir, &oldvn);
+
+		/* Dropping the references may sleep. */
+		lock_release(vfscache_lock);
+		vfscache_drop(olddir, oldvn);
+		lock_acquire(vfscache_lock);
+	}
+	lock_release(vfscache_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and statistics
+
+void
+vfscache_printstats(void)
+{
+	struct vfscache_entry *ce;
+	unsigned used = 0;
+
+	lock_acquire(vfscache_lock);
+	for (ce = vfscache_lruhead; ce != NULL; ce = ce->ce_lrunext) {
+		if (ce->ce_dir != NULL) {
+			used++;
+		}
+	}
+	kprintf("Name cache: %u entries of %u in use, %u positive\n",
+		used, (unsigned)VFSCACHE_SIZE, vfscache_npositive);
+	kprintf("  %u hits, %u negative hits, %u misses\n",
+		vfscache_hits, vfscache_neghits, vfscache_misses);
+	kprintf("  %u evictions, %u purges\n",
+		vfscache_evictions, vfscache_purges);
+	lock_release(vfscache_lock);
+}
+
+void
+vfscache_bootstrap(void)
+{
+	unsigned i;
+
+	vfscache_lock = lock_create("name cache");
+	if (vfscache_lock == NULL) {
+		panic("vfscache_bootstrap: Out of memory\n");
+	}
+
+	vfscache_lruhead = vfscache_lrutail = NULL;
+	for (i=0; i<VFSCACHE_SIZE; i++) {
+		vfscache_entries[i].ce_dir = NULL;
+		vfscache_entries[i].ce_vn = NULL;
+		vfscache_entries[i].ce_name[0] = 0;
+		vfscache_entries[i].ce_hashnext = NULL;
+		vfscache_lruaddtail(&vfscache_entries[i]);
+	}
+	vfscache_npositive = 0;
+	vfscache_gen = 0;
+}
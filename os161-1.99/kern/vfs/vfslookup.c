@@ -34,13 +34,15 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <limits.h>
+#include <stat.h>
 #include <lib.h>
-#include <synch.h>
+#include <spinlock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +53,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +79,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +93,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,9 +112,7 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
@@ -133,8 +129,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +182,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		spinlock_acquire(&bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -223,23 +220,107 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up a single path component NAME in directory DIR, going to
+ * the filesystem only if the name cache doesn't have the answer.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (vfscache_lookup(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == ENOENT) {
+		vfscache_enter(dir, name, NULL, gen);
+		return result;
+	}
+	if (result) {
+		return result;
+	}
+	vfscache_enter(dir, name, vn, gen);
+	*ret = vn;
+	return 0;
+}
+
+/*
+ * Walk PATH from directory DIR one component at a time, up to but not
+ * including the last component. Hands back the directory the last
+ * component is in and a pointer to that component, which is empty if
+ * PATH ends in a slash. In that case the component before the slash
+ * must be a directory. Consumes the reference to DIR.
+ */
+static
+int
+lookup_walk(struct vnode *dir, char *path,
+	    struct vnode **retdir, char **retname)
+{
+	struct vnode *next;
+	char *name, *s;
+	mode_t vtype;
+	int result;
+
+	name = path;
+	while ((s = strchr(name, '/')) != NULL) {
+		*s = 0;
+		/* Skip empty components, as in a//b */
+		if (*name != 0) {
+			result = lookup_component(dir, name, &next);
+			VOP_DECREF(dir);
+			if (result) {
+				return result;
+			}
+			dir = next;
+		}
+		name = s+1;
+	}
+
+	if (*name == 0) {
+		/* "file/" names nothing */
+		result = VOP_GETTYPE(dir, &vtype);
+		if (result == 0 && vtype != S_IFDIR) {
+			result = ENOTDIR;
+		}
+		if (result) {
+			VOP_DECREF(dir);
+			return result;
+		}
+	}
+
+	*retdir = dir;
+	*retname = name;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * Paths on filesystems are walked here a component at a time, through
+ * the name cache; the filesystem only ever sees single names. Paths
+ * on devices go to the device whole, as it may have its own ideas.
  */
 
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *name;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -249,41 +330,62 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		return EINVAL;
 	}
-	else {
+
+	if (startvn->vn_fs == NULL) {
 		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		VOP_DECREF(startvn);
+		return result;
+	}
+
+	result = lookup_walk(startvn, path, &dir, &name);
+	if (result) {
+		return result;
 	}
 
-	VOP_DECREF(startvn);
+	result = VOP_LOOKPARENT(dir, name, retval, buf, buflen);
+	VOP_DECREF(dir);
 
-	vfs_biglock_release();
 	return result;
 }
 
 int
 vfs_lookup(char *path, struct vnode **retval)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *name;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	if (startvn->vn_fs == NULL) {
+		result = VOP_LOOKUP(startvn, path, retval);
+		VOP_DECREF(startvn);
+		return result;
+	}
+
+	result = lookup_walk(startvn, path, &dir, &name);
+	if (result) {
+		return result;
+	}
+
+	if (*name == 0) {
+		/* Trailing slash; the directory itself. */
+		*retval = dir;
+		return 0;
+	}
 
-	VOP_DECREF(startvn);
-	vfs_biglock_release();
+	result = lookup_component(dir, name, retval);
+	VOP_DECREF(dir);
 	return result;
 }
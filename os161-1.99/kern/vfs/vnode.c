@@ -48,6 +48,11 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	KASSERT(vn!=NULL);
 	KASSERT(ops!=NULL);
 
+	vn->vn_openlock = lock_create("vnode_open");
+	if (vn->vn_openlock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
@@ -66,6 +71,9 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+	spinlock_cleanup(&vn->vn_countlock);
+	lock_destroy(vn->vn_openlock);
+	vn->vn_openlock = NULL;
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -83,11 +91,9 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
@@ -98,17 +104,24 @@ vnode_incref(struct vnode *vn)
 void
 vnode_decref(struct vnode *vn)
 {
+	bool destroy;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_refcount>0);
 	if (vn->vn_refcount>1) {
 		vn->vn_refcount--;
+		destroy = false;
 	}
 	else {
+		/* Leave the count at 1; VOP_RECLAIM sorts it out. */
+		destroy = true;
+	}
+	spinlock_release(&vn->vn_countlock);
+
+	if (destroy) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +129,6 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -129,9 +140,12 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	/* Wait out a close in progress; see vnode_decopen. */
+	lock_acquire(vn->vn_openlock);
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_opencount++;
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
+	lock_release(vn->vn_openlock);
 }
 
 /*
@@ -141,29 +155,35 @@ vnode_incopen(struct vnode *vn)
 void
 vnode_decopen(struct vnode *vn)
 {
+	bool doclose;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	/*
+	 * Hold vn_openlock through VOP_CLOSE, so the decision to close
+	 * and the close itself happen with nobody opening the vnode
+	 * again in between. (VOP_CLOSE can sleep, so vn_countlock
+	 * won't do.)
+	 */
+	lock_acquire(vn->vn_openlock);
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_opencount>0);
 	vn->vn_opencount--;
-
-	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
-		return;
-	}
-
-	result = VOP_CLOSE(vn);
-	if (result) {
-		// XXX: also lame.
-		// The FS should do what it can to make sure this code
-		// doesn't get reached...
-		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
+	doclose = (vn->vn_opencount == 0);
+	spinlock_release(&vn->vn_countlock);
+
+	if (doclose) {
+		result = VOP_CLOSE(vn);
+		if (result) {
+			// XXX: also lame.
+			// The FS should do what it can to make sure this
+			// code doesn't get reached...
+			kprintf("vfs: Warning: VOP_CLOSE: %s\n",
+				strerror(result));
+		}
 	}
-
-	vfs_biglock_release();
+	lock_release(vn->vn_openlock);
 }
 
 /*
@@ -173,7 +193,7 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
+	/* No locking: the counts are only checked for sanity. */
 
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
@@ -222,6 +242,4 @@ vnode_check(struct vnode *v, const char *opstr)
 		kprintf("vnode_check: vop_%s: warning: large opencount %d\n", 
 			opstr, v->vn_opencount);
 	}
-
-	vfs_biglock_release();
 }
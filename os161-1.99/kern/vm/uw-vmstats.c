@@ -3,23 +3,24 @@
 /* belongs in kern/vm/uw-vmstats.c */
 
 /* NOTE !!!!!! WARNING !!!!!
- * All of the functions whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally.
+ * The counters are kept per-cpu (see cpustat.h), so there is no
+ * global lock. All of the functions whose names begin with '_'
+ * assume that interrupts are already off on the current cpu
+ * (e.g., because a spinlock is held). All of the functions whose
+ * names do not begin with '_' ensure this locally.
  */
 
 #include <types.h>
 #include <lib.h>
-#include <synch.h>
-#include <spl.h>
+#include <cpu.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
-
-struct spinlock stats_lock = SPINLOCK_INITIALIZER;
+/*
+ * Per-cpu counters are never cleared once the system is running;
+ * instead, vmstats_init records their current totals here and
+ * vmstats_print reports the difference.
+ */
+static unsigned int stats_base[VMSTAT_COUNT];
 
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
@@ -41,23 +42,16 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  KASSERT(index < VMSTAT_COUNT);
+  cpustat_inc(CPUSTAT_VM(index));
 }
 
 /* ---------------------------------------------------------------------- */
+/* May be called again to reset the stats without shutting down the kernel. */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
-   */
-  spinlock_init(&stats_lock);
-
-  spinlock_acquire(&stats_lock);
-    _vmstats_init();
-  spinlock_release(&stats_lock);
+  _vmstats_init();
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,7 +59,16 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  _cpustat_inc(CPUSTAT_VM(index));
+}
+
+/* ---------------------------------------------------------------------- */
+/* Current value of a stat: the per-cpu total since vmstats_init */
+static
+unsigned int
+vmstats_get(unsigned int index)
+{
+  return cpustat_get(CPUSTAT_VM(index)) - stats_base[index];
 }
 
 /* ---------------------------------------------------------------------- */
@@ -81,15 +84,15 @@ _vmstats_init(void)
   }
 
   for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+    stats_base[i] = cpustat_get(CPUSTAT_VM(i));
   }
 
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
+/* NOTE: The totals are summed over the cpus without stopping them,
+ * so if other threads are still counting they are only a snapshot.
  * Just use this when there is only one thread remaining.
  */
 
@@ -102,6 +105,11 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  unsigned int stats_counts[VMSTAT_COUNT];
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats_counts[i] = vmstats_get(i);
+  }
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -0,0 +1,21 @@
+#ifndef _SYS_UIO_H_
+#define _SYS_UIO_H_
+
+/*
+ * Get struct iovec from the kernel.
+ */
+#include <sys/types.h>
+#include <kern/iovec.h>
+
+/*
+ * Scatter/gather I/O. These are like read, write, pread, and pwrite,
+ * except that the data goes to or comes from the IOVCNT buffers
+ * described by IOV, in order, as if they were one buffer. IOVCNT may
+ * be at most IOV_MAX (see limits.h).
+ */
+int readv(int filehandle, const struct iovec *iov, int iovcnt);
+int writev(int filehandle, const struct iovec *iov, int iovcnt);
+int preadv(int filehandle, const struct iovec *iov, int iovcnt, off_t pos);
+int pwritev(int filehandle, const struct iovec *iov, int iovcnt, off_t pos);
+
+#endif /* _SYS_UIO_H_ */
@@ -56,6 +56,10 @@
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
+ *     readv:    sys/uio.h
+ *     writev:   sys/uio.h
+ *     preadv:   sys/uio.h
+ *     pwritev:  sys/uio.h
  *
  * If this were standard Unix, more prototypes would go in other
  * header files as well, as follows:
@@ -154,6 +158,7 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+/* readv, writev, preadv, pwritev - see sys/uio.h */
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -56,11 +56,59 @@
 
 #include "disk.h"
 
+/* Block size of the volume, from the superblock. */
+static uint32_t blocksize;
+
+/*
+ * Show where the journal is and what's in it.
+ */
+static
+void
+dumpjournal(uint32_t start, uint32_t size)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+	struct sfs_jblock *jb = (struct sfs_jblock *)buf;
+	uint32_t pos, seq, count;
+
+	printf("Journal: %u blocks at %u\n", size, start);
+
+	diskread(buf, start);
+	if (SWAPL(jb->jb_magic) != SFS_JMAGIC) {
+		printf("    [bad journal header]\n");
+		return;
+	}
+	seq = SWAPL(jb->jb_seq);
+	printf("    [next transaction %u]\n", seq);
+
+	/* List transactions that look complete; recovery would replay them. */
+	pos = 1;
+	while (pos + 2 <= size) {
+		diskread(buf, start + pos);
+		count = SWAPL(jb->jb_count);
+		if (SWAPL(jb->jb_magic) != SFS_JDESCMAGIC ||
+		    SWAPL(jb->jb_seq) != seq ||
+		    count > SFS_JMAXBLOCKS || pos + count + 2 > size) {
+			break;
+		}
+		diskread(buf, start + pos + 1 + count);
+		if (SWAPL(jb->jb_magic) != SFS_JCOMMITMAGIC ||
+		    SWAPL(jb->jb_seq) != seq) {
+			break;
+		}
+		printf("    [transaction %u: %u blocks at %u]\n",
+		       seq, count, start + pos + 1);
+		pos += count + 2;
+		seq++;
+	}
+}
+
 static
 uint32_t
 dumpsb(void)
 {
 	struct sfs_super sp;
+
+	/* Read just the superblock, before we know the block size. */
 	diskread(&sp, SFS_SB_LOCATION);
 	if (SWAPL(sp.sp_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
@@ -68,6 +116,27 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
+	printf("Format version: %u\n", SWAPL(sp.sp_version));
+
+	/* Volumes before version 2 don't record it; they use 512. */
+	blocksize = SWAPL(sp.sp_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_BLOCKSIZE;
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    blocksize % diskblocksize() != 0) {
+		errx(1, "Unsupported block size %u", blocksize);
+	}
+	printf("Block size: %u\n", blocksize);
+	disksetblocksize(blocksize);
+
+	if (SWAPL(sp.sp_journalblocks) == 0) {
+		printf("No journal\n");
+	}
+	else {
+		dumpjournal(SWAPL(sp.sp_journalstart),
+			    SWAPL(sp.sp_journalblocks));
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -76,8 +145,8 @@ static
 void
 dodirblock(uint32_t block)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = blocksize/sizeof(struct sfs_dir);
 	int i;
 
 	diskread(&sds, block);
@@ -95,16 +164,51 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which is at
+ * the given level of indirection. Returns the number of blocks.
+ */
+static
+uint32_t
+dumpdirindirect(uint32_t iblock, int level)
+{
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t block, nblocks=0;
+	unsigned i;
+
+	if (iblock == 0) {
+		return 0;
+	}
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (level > 1) {
+			nblocks += dumpdirindirect(block, level-1);
+		}
+		else {
+			dodirblock(block);
+			nblocks++;
+		}
+	}
+	return nblocks;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
+	char data[SFS_MAXBLOCKSIZE];
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
-	diskread(&sfi, ino);
+	/* The inode is at the start of its block */
+	diskread(data, ino);
+	memcpy(&sfi, data, sizeof(sfi));
 
 	nentries = SWAPL(sfi.sfi_size) / sizeof(struct sfs_dir);
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
@@ -119,16 +223,9 @@ dumpdir(uint32_t ino)
 			nblocks++;
 		}
 	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
-	}
+	nblocks += dumpdirindirect(SWAPL(sfi.sfi_indirect), 1);
+	nblocks += dumpdirindirect(SWAPL(sfi.sfi_dindirect), 2);
+	nblocks += dumpdirindirect(SWAPL(sfi.sfi_tindirect), 3);
 	printf("    %u blocks in directory\n", nblocks);
 }
 
@@ -136,15 +233,17 @@ static
 void
 dumpbits(uint32_t fsblocks)
 {
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	uint32_t i, j;
-	char data[SFS_BLOCKSIZE];
+	char data[SFS_MAXBLOCKSIZE];
 
-	printf("Freemap: %u blocks (%u %u %u)\n", nblocks, SFS_BITMAPSIZE(fsblocks), fsblocks, SFS_BLOCKBITS);
+	printf("Freemap: %u blocks (%u %u %u)\n", nblocks,
+	       SFS_BITMAPSIZE(fsblocks, blocksize), fsblocks,
+	       SFS_BLOCKBITS(blocksize));
 
 	for (i=0; i<nblocks; i++) {
 		diskread(data, SFS_MAP_LOCATION+i);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			printf("%02x", (unsigned char)data[j]);
 			if (j%32==31) {
 				printf("\n");
@@ -48,7 +48,8 @@
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nblocks;		/* size of disk in sectors */
+static uint32_t fsblocksize = BLOCKSIZE;	/* unit of diskread/diskwrite */
 
 void
 opendisk(const char *path)
@@ -97,11 +98,18 @@ diskblocksize(void)
 	return BLOCKSIZE;
 }
 
+void
+disksetblocksize(uint32_t size)
+{
+	assert(size >= BLOCKSIZE && size % BLOCKSIZE == 0);
+	fsblocksize = size;
+}
+
 uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nblocks / (fsblocksize / BLOCKSIZE);
 }
 
 void
@@ -109,21 +117,23 @@ diskwrite(const void *data, uint32_t block)
 {
 	const char *cdata = data;
 	uint32_t tot=0;
+	off_t pos;
 	int len;
 
 	assert(fd>=0);
 
+	pos = (off_t)block * fsblocksize;
 #ifdef HOST
 	// skip over disk file header
-	block++;
+	pos += BLOCKSIZE;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, pos, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < fsblocksize) {
+		len = write(fd, cdata + tot, fsblocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -142,21 +152,23 @@ diskread(void *data, uint32_t block)
 {
 	char *cdata = data;
 	uint32_t tot=0;
+	off_t pos;
 	int len;
 
 	assert(fd>=0);
 
+	pos = (off_t)block * fsblocksize;
 #ifdef HOST
 	// skip over disk file header
-	block++;
+	pos += BLOCKSIZE;
 #endif
 
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, pos, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < fsblocksize) {
+		len = read(fd, cdata + tot, fsblocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -164,7 +176,7 @@ diskread(void *data, uint32_t block)
 			err(1, "read");
 		}
 		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+			err(1, "unexpected EOF in mid-block");
 		}
 		tot += len;
 	}
@@ -29,7 +29,14 @@
 
 void opendisk(const char *path);
 
+/* Device sector size. */
 uint32_t diskblocksize(void);
+
+/*
+ * Set the block size diskread, diskwrite, and diskblocks work in. It
+ * must be a multiple of the sector size, which is the default.
+ */
+void disksetblocksize(uint32_t size);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -57,6 +58,22 @@
 
 #define MAXBITBLOCKS 32
 
+/* Block size of the filesystem being made. */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
+/*
+ * Journal size: JOURNALFRAC of the volume, but at most JOURNALMAX
+ * blocks. If that doesn't leave room for a transaction holding the
+ * whole freemap plus JOURNALMINFREE more blocks (the kernel's
+ * per-operation reservation), there's no journal.
+ */
+#define JOURNALMAX      64
+#define JOURNALFRAC     8
+#define JOURNALMINFREE  8
+
+/* Where the journal goes, and how big it is (0 for none). */
+static uint32_t journalstart, journalblocks;
+
 static
 void
 check(void)
@@ -64,8 +81,12 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jblock)==SFS_BLOCKSIZE);
 }
 
+/* Scratch space for one block. */
+static char blockbuf[SFS_MAXBLOCKSIZE];
+
 static
 void
 writesuper(const char *volname, uint32_t nblocks)
@@ -81,8 +102,15 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
-
-	diskwrite(&sp, SFS_SB_LOCATION);
+	sp.sp_version = SWAPL(SFS_VERSION);
+	sp.sp_blocksize = SWAPL(blocksize);
+	sp.sp_journalstart = SWAPL(journalstart);
+	sp.sp_journalblocks = SWAPL(journalblocks);
+
+	/* The superblock is at the start of block 0; the rest is zero. */
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, &sp, sizeof(sp));
+	diskwrite(blockbuf, SFS_SB_LOCATION);
 }
 
 static
@@ -97,10 +125,12 @@ writerootdir(void)
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
 
-	diskwrite(&sfi, SFS_ROOT_LOCATION);
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, &sfi, sizeof(sfi));
+	diskwrite(blockbuf, SFS_ROOT_LOCATION);
 }
 
-static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
+static char bitbuf[MAXBITBLOCKS*SFS_MAXBLOCKSIZE];
 
 static
 void
@@ -118,8 +148,8 @@ void
 writebitmap(uint32_t fsblocks)
 {
 
-	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nbits = SFS_BITMAPSIZE(fsblocks, blocksize);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	char *ptr;
 	uint32_t i;
 
@@ -133,32 +163,113 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<journalblocks; i++) {
+		doallocbit(journalstart+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
 
 	for (i=0; i<nblocks; i++) {
-		ptr = bitbuf + i*SFS_BLOCKSIZE;
+		ptr = bitbuf + i*blocksize;
 		diskwrite(ptr, SFS_MAP_LOCATION+i);
 	}
 }
 
+/*
+ * Decide where the journal goes and how big it is.
+ */
+static
+void
+layoutjournal(uint32_t fsblocks)
+{
+	uint32_t fmblocks, maxtxn;
+
+	fmblocks = SFS_BITBLOCKS(fsblocks, blocksize);
+	journalstart = SFS_MAP_LOCATION + fmblocks;
+	journalblocks = fsblocks / JOURNALFRAC;
+	if (journalblocks > JOURNALMAX) {
+		journalblocks = JOURNALMAX;
+	}
+
+	/* Largest transaction; the same computation as the kernel's. */
+	maxtxn = SFS_JMAXBLOCKS;
+	if (maxtxn > SFS_JMAXBYTES / blocksize) {
+		maxtxn = SFS_JMAXBYTES / blocksize;
+	}
+	if (journalblocks < 3) {
+		maxtxn = 0;
+	}
+	else if (maxtxn > journalblocks - 3) {
+		maxtxn = journalblocks - 3;
+	}
+
+	if (maxtxn < fmblocks + JOURNALMINFREE) {
+		warnx("Volume too small or too large for a journal");
+		journalstart = journalblocks = 0;
+	}
+}
+
+/*
+ * Empty the journal and write its header.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jblock jb;
+	uint32_t i;
+
+	if (journalblocks == 0) {
+		return;
+	}
+
+	bzero(blockbuf, blocksize);
+	for (i=1; i<journalblocks; i++) {
+		diskwrite(blockbuf, journalstart+i);
+	}
+
+	bzero((void *)&jb, sizeof(jb));
+	jb.jb_magic = SWAPL(SFS_JMAGIC);
+	jb.jb_seq = SWAPL(1);
+	memcpy(blockbuf, &jb, sizeof(jb));
+	diskwrite(blockbuf, journalstart);
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: mksfs [-b blocksize] device/diskfile volume-name");
+}
+
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	if (argc==5 && !strcmp(argv[1], "-b")) {
+		blocksize = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		usage();
 	}
 
 	check();
 
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize-1)) != 0) {
+		errx(1, "Block size must be a power of 2 from %u to %u",
+		     SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
+	}
+
 	volname = argv[2];
 
 	/* Remove one trailing colon from volname, if present */
@@ -177,17 +288,20 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
-		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+	if (blocksize % sectorsize != 0) {
+		errx(1, "Block size %u is not a multiple of the device's "
+		     "sector size %u\n", blocksize, sectorsize);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
+	layoutjournal(size);
 	writesuper(volname, size);
 	writerootdir();
 	writebitmap(size);
+	writejournal();
 
 	closedisk();
 
@@ -66,6 +66,10 @@
 
 static int badness=0;
 
+/* Block size of the volume, and entries per indirect block. */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+static uint32_t dbperidb;
+
 static
 void
 setbadness(int code)
@@ -83,6 +87,10 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_version = SWAPL(sp->sp_version);
+	sp->sp_blocksize = SWAPL(sp->sp_blocksize);
+	sp->sp_journalstart = SWAPL(sp->sp_journalstart);
+	sp->sp_journalblocks = SWAPL(sp->sp_journalblocks);
 }
 
 static
@@ -139,8 +147,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<dbperidb; i++) {
 		entries[i] = SWAPL(entries[i]);
 	}
 }
@@ -169,9 +177,37 @@ domalloc(size_t len)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * The superblock and inodes are smaller than a block when the block
+ * size is larger than SFS_BLOCKSIZE; they live at the start of their
+ * block and the rest of the block is zero.
+ */
+
+static char blockbuf[SFS_MAXBLOCKSIZE];
+
+static
+void
+readinode(uint32_t ino, struct sfs_inode *sfi)
+{
+	diskread(blockbuf, ino);
+	memcpy(sfi, blockbuf, sizeof(*sfi));
+}
+
+static
+void
+writeinode(uint32_t ino, const struct sfs_inode *sfi)
+{
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, sfi, sizeof(*sfi));
+	diskwrite(blockbuf, ino);
+}
+
+////////////////////////////////////////////////////////////
+
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block used by the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -194,7 +230,7 @@ static
 void
 bitmap_init(uint32_t bitblocks)
 {
-	size_t i, mapsize = bitblocks * SFS_BLOCKSIZE;
+	size_t i, mapsize = bitblocks * blocksize;
 	bitmapdata = domalloc(mapsize * sizeof(uint8_t));
 	tofreedata = domalloc(mapsize * sizeof(uint8_t));
 	for (i=0; i<mapsize; i++) {
@@ -210,6 +246,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -292,7 +329,8 @@ reportbits(uint32_t bitblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = bitblock*SFS_BLOCKBITS + byte*CHAR_BIT + y;
+			blocknum = bitblock*SFS_BLOCKBITS(blocksize)
+				+ byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in bitmap",
 			      (unsigned long) blocknum, what);
 		}
@@ -303,18 +341,18 @@ static
 void
 check_bitmap(void)
 {
-	uint8_t bits[SFS_BLOCKSIZE], *found, *tofree, tmp;
+	uint8_t bits[SFS_MAXBLOCKSIZE], *found, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 
 	for (i=0; i<bitblocks; i++) {
 		diskread(bits, SFS_MAP_LOCATION+i);
 		swapbits(bits);
-		found = bitmapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		found = bitmapdata + i*blocksize;
+		tofree = tofreedata + i*blocksize;
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((found[j] & tofree[j])==0);
 
@@ -457,7 +495,7 @@ adjust_filelinks(void)
 			/* directory */
 			continue;
 		}
-		diskread(&sfi, inodes[i].ino);
+		readinode(inodes[i].ino, &sfi);
 		swapinode(&sfi);
 		assert(sfi.sfi_type == SFS_TYPE_FILE);
 		if (sfi.sfi_linkcount != inodes[i].linkcount) {
@@ -468,7 +506,7 @@ adjust_filelinks(void)
 			sfi.sfi_linkcount = inodes[i].linkcount;
 			setbadness(EXIT_RECOV);
 			swapinode(&sfi);
-			diskwrite(&sfi, inodes[i].ino);
+			writeinode(inodes[i].ino, &sfi);
 		}
 		count_files++;
 	}
@@ -508,6 +546,101 @@ checkbadstring(char *buf)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Replay the journal the way the kernel does at mount, so we check
+ * what the kernel will see, and leave it empty. Returns 1 if the
+ * superblock (already byte-swapped) was changed.
+ */
+static
+int
+check_journal(struct sfs_super *sp)
+{
+	static char descbuf[SFS_MAXBLOCKSIZE], databuf[SFS_MAXBLOCKSIZE];
+	struct sfs_jblock *jb = (struct sfs_jblock *)descbuf;
+	struct sfs_jblock *cb = (struct sfs_jblock *)databuf;
+	uint32_t start, size, pos, seq, count, home, i;
+	unsigned ntxns;
+	int bad;
+
+	start = sp->sp_journalstart;
+	size = sp->sp_journalblocks;
+	if (size == 0) {
+		return 0;
+	}
+	if (start < SFS_MAP_LOCATION + bitblocks || size < 3 ||
+	    size > nblocks || start > nblocks - size) {
+		warnx("Journal location invalid (journal removed)");
+		setbadness(EXIT_RECOV);
+		sp->sp_journalstart = sp->sp_journalblocks = 0;
+		return 1;
+	}
+
+	diskread(descbuf, start);
+	if (SWAPL(jb->jb_magic) != SFS_JMAGIC) {
+		warnx("Journal header invalid (fixed)");
+		setbadness(EXIT_RECOV);
+		seq = 1;
+	}
+	else {
+		seq = SWAPL(jb->jb_seq);
+		ntxns = 0;
+		pos = 1;
+		while (pos + 2 <= size) {
+			diskread(descbuf, start + pos);
+			count = SWAPL(jb->jb_count);
+			if (SWAPL(jb->jb_magic) != SFS_JDESCMAGIC ||
+			    SWAPL(jb->jb_seq) != seq ||
+			    count > SFS_JMAXBLOCKS || pos + count + 2 > size) {
+				break;
+			}
+			diskread(databuf, start + pos + 1 + count);
+			if (SWAPL(cb->jb_magic) != SFS_JCOMMITMAGIC ||
+			    SWAPL(cb->jb_seq) != seq) {
+				break;
+			}
+
+			bad = 0;
+			for (i=0; i<count; i++) {
+				home = SWAPL(jb->jb_blocks[i]);
+				if (home == SFS_SB_LOCATION ||
+				    home >= nblocks ||
+				    (home >= start && home < start + size)) {
+					bad = 1;
+				}
+			}
+			if (bad) {
+				warnx("Journal transaction %lu has "
+				      "invalid blocks (discarded)",
+				      (unsigned long) seq);
+				setbadness(EXIT_RECOV);
+				break;
+			}
+
+			for (i=0; i<count; i++) {
+				diskread(databuf, start + pos + 1 + i);
+				diskwrite(databuf, SWAPL(jb->jb_blocks[i]));
+			}
+			ntxns++;
+			pos += count + 2;
+			seq++;
+		}
+		if (ntxns == 0) {
+			/* Nothing to do; leave it alone. */
+			return 0;
+		}
+		warnx("Replayed %u journal transactions", ntxns);
+		setbadness(EXIT_RECOV);
+		seq++;
+	}
+
+	/* Empty it. */
+	bzero(descbuf, blocksize);
+	jb->jb_magic = SWAPL(SFS_JMAGIC);
+	jb->jb_seq = SWAPL(seq);
+	diskwrite(descbuf, start);
+	return 0;
+}
+
 static
 void
 check_sb(void)
@@ -521,16 +654,34 @@ check_sb(void)
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
+	if (sp.sp_version > SFS_VERSION) {
+		errx(EXIT_UNRECOV, "Unsupported sfs version %lu",
+		     (unsigned long) sp.sp_version);
+	}
+
+	/* Volumes before version 2 don't record it; they use 512. */
+	blocksize = sp.sp_blocksize;
+	if (blocksize == 0) {
+		blocksize = SFS_BLOCKSIZE;
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize-1)) != 0 ||
+	    blocksize % diskblocksize() != 0) {
+		errx(EXIT_UNRECOV, "Unsupported block size %lu",
+		     (unsigned long) blocksize);
+	}
+	dbperidb = SFS_DBPERIDB(blocksize);
+	disksetblocksize(blocksize);
 
 	assert(nblocks==0);
 	assert(bitblocks==0);
 	nblocks = sp.sp_nblocks;
-	bitblocks = SFS_BITBLOCKS(nblocks);
+	bitblocks = SFS_BITBLOCKS(nblocks, blocksize);
 	assert(nblocks>0);
 	assert(bitblocks>0);
 
 	bitmap_init(bitblocks);
-	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS; i++) {
+	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS(blocksize); i++) {
 		bitmap_mark(i, B_PASTEND, 0);
 	}
 
@@ -545,15 +696,24 @@ check_sb(void)
 		schanged = 1;
 	}
 
+	if (check_journal(&sp)) {
+		schanged = 1;
+	}
+
 	if (schanged) {
 		swapsb(&sp);
-		diskwrite(&sp, SFS_SB_LOCATION);
+		bzero(blockbuf, blocksize);
+		memcpy(blockbuf, &sp, sizeof(sp));
+		diskwrite(blockbuf, SFS_SB_LOCATION);
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+	for (i=0; i<sp.sp_journalblocks; i++) {
+		bitmap_mark(sp.sp_journalstart+i, B_JOURNAL, 0);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -564,7 +724,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     uint32_t nblocks, uint32_t *badcountp, 
 		     int isdir, int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	uint32_t i, ct;
 
 	if (*ientry !=0) {
@@ -573,13 +733,13 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		bitmap_mark(*ientry, B_IBLOCK, ino);
 	}
 	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			entries[i] = 0;
 		}
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			check_indirect_block(ino, &entries[i], 
 					     blockp, nblocks, 
 					     badcountp,
@@ -590,7 +750,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			if (*blockp < nblocks) {
 				if (entries[i] != 0) {
 					bitmap_mark(entries[i],
@@ -612,7 +772,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -640,8 +800,8 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 
 	badcount = 0;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
-	nblocks = size/SFS_BLOCKSIZE;
+	size = SFS_ROUNDUP(sfi->sfi_size, blocksize);
+	nblocks = size/blocksize;
 
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
@@ -709,7 +869,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -721,10 +881,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/dbperidb);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < dbperidb);
 		return entries[offset];
 	}
 }
@@ -767,14 +927,14 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #endif
 
 #define BMAP_DMAX   BMAP_ND
-#define BMAP_IMAX   (BMAP_DMAX+SFS_DBPERIDB*BMAP_NI)
-#define BMAP_IIMAX  (BMAP_IMAX+SFS_DBPERIDB*BMAP_NII)
-#define BMAP_IIIMAX (BMAP_IIMAX+SFS_DBPERIDB*BMAP_NIII)
+#define BMAP_IMAX   (BMAP_DMAX+dbperidb*BMAP_NI)
+#define BMAP_IIMAX  (BMAP_IMAX+dbperidb*BMAP_NII)
+#define BMAP_IIIMAX (BMAP_IIMAX+dbperidb*BMAP_NIII)
 
 #define BMAP_DSIZE	1
-#define BMAP_ISIZE	(BMAP_DSIZE*SFS_DBPERIDB)
-#define BMAP_IISIZE	(BMAP_ISIZE*SFS_DBPERIDB)
-#define BMAP_IIISIZE	(BMAP_IISIZE*SFS_DBPERIDB)
+#define BMAP_ISIZE	(BMAP_DSIZE*dbperidb)
+#define BMAP_IISIZE	(BMAP_ISIZE*dbperidb)
+#define BMAP_IIISIZE	(BMAP_IISIZE*dbperidb)
 
 static
 uint32_t
@@ -807,7 +967,7 @@ static
 void
 dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 
@@ -821,7 +981,7 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 		}
 		else {
 			warnx("Warning: sparse directory found");
-			bzero(d + i*atonce, SFS_BLOCKSIZE);
+			bzero(d + i*atonce, blocksize);
 		}
 	}
 }
@@ -830,7 +990,7 @@ static
 void
 dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j, bad;
 
@@ -976,7 +1136,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
 
-	diskread(&sfi, ino);
+	readinode(ino, &sfi);
 	swapinode(&sfi);
 
 	if (remember_dir(ino, pathsofar)) {
@@ -1002,7 +1162,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
 	maxdirentries = SFS_ROUNDUP(ndirentries, 
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+				    blocksize/sizeof(struct sfs_dir));
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
@@ -1142,7 +1302,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
 			struct sfs_inode subsfi;
 
-			diskread(&subsfi, direntries[i].sfd_ino);
+			readinode(direntries[i].sfd_ino, &subsfi);
 			swapinode(&subsfi);
 			snprintf(path, sizeof(path), "%s/%s", 
 				 pathsofar, direntries[i].sfd_name);
@@ -1152,8 +1312,8 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 				if (check_inode_blocks(direntries[i].sfd_ino,
 						       &subsfi, 0)) {
 					swapinode(&subsfi);
-					diskwrite(&subsfi, 
-						  direntries[i].sfd_ino);
+					writeinode(direntries[i].sfd_ino, 
+						   &subsfi);
 				}
 				observe_filelink(direntries[i].sfd_ino);
 				break;
@@ -1200,7 +1360,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	if (ichanged) {
 		swapinode(&sfi);
-		diskwrite(&sfi, ino);
+		writeinode(ino, &sfi);
 	}
 
 	free(direntries);
@@ -1215,7 +1375,7 @@ void
 check_root_dir(void)
 {
 	struct sfs_inode sfi;
-	diskread(&sfi, SFS_ROOT_LOCATION);
+	readinode(SFS_ROOT_LOCATION, &sfi);
 	swapinode(&sfi);
 
 	switch (sfi.sfi_type) {
@@ -1231,7 +1391,7 @@ check_root_dir(void)
 		setbadness(EXIT_RECOV);
 		sfi.sfi_type = SFS_TYPE_DIR;
 		swapinode(&sfi);
-		diskwrite(&sfi, SFS_ROOT_LOCATION);
+		writeinode(SFS_ROOT_LOCATION, &sfi);
 		break;
 	}
 
@@ -1254,6 +1414,7 @@ main(int argc, char **argv)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jblock)==SFS_BLOCKSIZE);
 
 	opendisk(argv[1]);
 